@@ -0,0 +1,415 @@
+#include "IMU.h"
+#include "TWI_290.h"
+#include "UART.h"
+#include "timebase.h"
+#include "US_sensor.h"
+#include "timer1_servo.h"
+#include "heading.h"
+#include "gap_select.h"
+#include "convert.h"
+#include "IR_sensor.h"
+#include "params.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef BENCH_SIMAVR
+#include <avr/avr_mcu_section.h>
+AVR_MCU(F_CPU, "atmega328p");
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);  // Bytes written to GPIOR0 come out on simavr's stdout
+#endif
+
+/*
+  Benchmark harness for simavr. Every routine is called through the same function pointer with
+  interrupts off and timed with Timer1 at the full 16MHz, so the numbers are CPU cycles. The cost of
+  the timing itself (an empty call) is taken off. Each one runs BENCH_REPEATS times, after its setup
+  function each time, and the min and max are reported.
+
+  Stack use is measured by painting the free RAM below the stack pointer before the call and finding the
+  deepest byte that was changed afterwards.
+
+  Output, one line per benchmark, on the simulator console:
+    BENCH <name> <kind> <symbol> <min cycles> <max cycles> <stack bytes>
+  kind is "fn", "isr" (an interrupt handler, called directly) or "cli" (a routine with a critical
+  section). Every ISR and every routine with a cli() in the firmware is here, except the profiler's,
+  which is only built with PROFILER_ENABLE. The worst case interrupt latency is bounded by the longest
+  "isr" plus the longest "cli" (timed whole, so on the safe side) plus 7 cycles of hardware response.
+  symbol is what to look up in the ELF (avr-nm -S) for the flash size.
+
+  Build and run by hand, from the top of the tree:
+    avr-gcc -mmcu=atmega328p -Os -std=gnu99 -Wall -DBENCH_SIMAVR -I/usr/include/simavr -Isrc \
+            -o bench/bench.elf bench/bench.c bench/twi_stub.c bench/twi_bench.c src/IMU.c src/UART.c \
+            src/timebase.c src/US_sensor.c src/timer1_servo.c src/heading.c src/gap_select.c \
+            src/IR_sensor.c src/params.c
+    simavr -m atmega328p -f 16000000 bench/bench.elf
+  There are no budgets or pass/fail yet; those wait until there are real numbers to set them from.
+*/
+
+#define BENCH_REPEATS 4
+#define STACK_PAINT 0xC5
+#define STACK_MARGIN 8          // Bytes just below SP left unpainted (the runner's own call)
+
+typedef struct {
+  const char *name;             // All in flash
+  const char *kind;
+  const char *symbol;
+  void (*setup)(void);
+  void (*run)(void);
+} bench_t;
+
+extern uint8_t __heap_start;    // End of .bss, from the linker script
+
+// The handlers under test, defined with ISR() in their own modules
+void INT0_vect(void);
+void INT1_vect(void);
+void TIMER2_OVF_vect(void);
+void TIMER1_CAPT_vect(void);
+void USART_UDRE_vect(void);
+void USART_RX_vect(void);
+void ADC_vect(void);
+void TWI_vect(void);
+
+// The real TWI engine, on registers in RAM (twi_bench.c)
+extern volatile uint8_t bench_twcr, bench_twsr, bench_twdr;
+uint8_t bench_TWI_submit(twi_transaction_t *t);
+uint8_t bench_TWI_busy(void);
+extern twi_transaction_t *twi_stub_last;
+
+//*************** Console ***************
+
+static void console_char(char c)
+{
+  GPIOR0 = c;
+}
+
+static void console_string_P(const char *s)
+{
+  char c;
+  while((c = pgm_read_byte(s++)))
+    console_char(c);
+}
+
+static void console_u32(uint32_t value)
+{
+  char digits[10];
+  uint8_t n = 0;
+
+  // Only at the end of a run, so the division doesn't matter
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while(value);
+
+  while(n)
+    console_char(digits[--n]);
+}
+
+//*************** Routines under test ***************
+
+static float gx, gy, gz;
+static angle_q16_t ax, ay, az;
+static imu_fifo_sample_t sample = {120, -340, 16500, -25, 40, 130};
+static scan_t scan;
+
+static void nothing(void) {}
+
+static void b_read_gyro(void) { read_gyro(&gx, &gy, &gz); }
+static void b_read_gyro_raw(void) { int16_t x, y, z; read_gyro_raw(&x, &y, &z); }
+static void b_update_gyro_angles(void) { update_gyro_angles(&gx, &gy, &gz); }
+static void b_update_gyro_angles_fx(void) { update_gyro_angles_fx(&ax, &ay, &az); }
+static void b_update_fused_angles_fifo(void) { update_fused_angles_fifo(&ax, &ay, &az); }
+static void b_imu_fusion_update(void) { imu_fusion_update(&sample, 10000, &ax, &ay, &az); }
+
+static void flush_uart(void) { uart_txFlush(); }
+static void b_uart_txU16(void) { uart_txU16(65535); }
+static void b_uart_txFormatted(void) { uart_txFormatted("yaw %d range %u\n", -179, 500); }
+static void b_uart_txFormatted_q16(void) { uart_txFormatted("yaw %.2q\n", -ANGLE_Q16(179) - 0x8000); }
+
+// What uart_txFormatted() was before it had its own formatter, to compare against
+static void libc_formatted(const char *format, ...)
+{
+  char buffer[64];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  uart_txString(buffer);
+}
+static void b_libc_formatted(void) { libc_formatted("yaw %d range %u\n", -179, 500); }
+
+// What set_servo_to_yaw() used to do: yaw to a servo pulse, now through the heading controller
+static void setup_steering(void) { heading_set(ANGLE_Q16(90)); }
+static void b_steering(void)
+{
+  angle_q16_t servo_heading = heading_update(ANGLE_Q16(12), yaw_rate_to_angle(20000));
+  servo_move_to(servo_heading_q16_to_pulse(servo_heading), SERVO_RATE(500), SERVO_ACCEL(5000));
+}
+
+// A full sweep with an opening on the left
+static void setup_gap_select(void)
+{
+  for(uint8_t i = 0; i < SCAN_MAX_POINTS; i++) {
+    scan.points[i].heading = 90 - 8 * i;
+    scan.points[i].range_cm = (i < 8) ? 300 : 30 + i;
+  }
+  scan.count = SCAN_MAX_POINTS;
+}
+static void b_gap_select(void) { gap_result_t gaps; gap_select(&scan, 37, GAP_BINS_FOR_WIDTH(30, 37), &gaps); }
+
+// Echo pin as an output, so the ISR sees whatever level we drive
+static void echo_level(uint8_t high)
+{
+  DDRD |= (1 << ECHO_PIN);
+  if(high)
+    PORTD |= (1 << ECHO_PIN);
+  else
+    PORTD &= ~(1 << ECHO_PIN);
+}
+
+// Falling edge that completes a measurement, the longest path through the ISR
+static void setup_int0(void)
+{
+  US_start();
+  echo_level(1);
+  INT0_vect();
+  cli();  // The ISR's reti turned interrupts back on
+  echo_level(0);
+}
+
+static void setup_servo_ramp(void) { servo_move_to(SERVO_MAX, SERVO_RATE(500), SERVO_ACCEL(5000)); }
+static void setup_udre(void) { uart_txFlush(); uart_txChar('x'); }
+
+// The last conversion of a result, which writes it to the (emptied) buffer
+static void setup_adc(void)
+{
+  uint16_t reading;
+
+  while(IR_read(&reading));
+  for(uint8_t i = 0; i < IR_OVERSAMPLE - 1; i++) {
+    ADC_vect();
+    cli();
+  }
+}
+
+static void setup_rx(void) { while(uart_rxReady()) uart_rxChar(); }
+
+static imu_frame_t twi_frame;
+static twi_transaction_t twi_frame_read, twi_next_read;
+static uint8_t twi_next_buffer[2];
+
+// One bus event into the real engine
+static void twi_event(uint8_t status)
+{
+  bench_twsr = status;
+  TWI_vect();
+  cli();
+}
+
+// Fail whatever is queued, and leave the bus with no STOP in progress
+static void twi_reset(void)
+{
+  while(bench_TWI_busy()) {
+    bench_twcr = 0;
+    twi_event(TW_MT_SLA_NACK);
+  }
+  bench_twcr = 0;
+}
+
+// The IMU's frame read, with its real completion callback (taken from what start_imu_frame() hands the
+// stub), one byte from the end with another read queued behind it. The last byte finishes one
+// transaction, runs the callback and starts the next: the longest path through TWI_vect
+static void setup_twi(void)
+{
+  twi_reset();
+
+  start_imu_frame(&twi_frame);
+  twi_frame_read = *twi_stub_last;
+  twi_next_read = twi_frame_read;
+  twi_next_read.length = sizeof(twi_next_buffer);
+  twi_next_read.buffer = twi_next_buffer;
+  twi_next_read.callback = 0;
+
+  bench_TWI_submit(&twi_frame_read);
+  bench_TWI_submit(&twi_next_read);
+
+  twi_event(TW_START);
+  twi_event(TW_MT_SLA_ACK);
+  twi_event(TW_MT_DATA_ACK);
+  twi_event(TW_REP_START);
+  twi_event(TW_MR_SLA_ACK);
+  for(uint8_t i = 0; i < IMU_FRAME_BYTES - 1; i++)
+    twi_event(TW_MR_DATA_ACK);
+
+  bench_twsr = TW_MR_DATA_NACK;
+}
+
+static void b_int0(void) { INT0_vect(); }
+static void b_int1(void) { INT1_vect(); }
+static void b_timer2_ovf(void) { TIMER2_OVF_vect(); }
+static void b_timer1_capt(void) { TIMER1_CAPT_vect(); }
+static void b_udre(void) { USART_UDRE_vect(); }
+static void b_rx(void) { USART_RX_vect(); }
+static void b_adc(void) { ADC_vect(); }
+static void b_twi(void) { TWI_vect(); }
+
+static void b_micros(void) { micros(); }
+static void b_millis(void) { millis(); }
+static void b_US_poll(void) { US_poll(); }
+static void b_US_get_result(void) { us_result_t r; US_get_result(&r); }
+static void b_US_start(void) { US_start(); }
+static void b_timebase_ticks(void) { timebase_ticks(); }
+static void b_set_servo_pulse(void) { set_servo_pulse(SERVO_MIDDLE); }
+static void b_servo_move_to(void) { servo_move_to(SERVO_MAX, SERVO_RATE(500), SERVO_ACCEL(5000)); }
+static void b_servo_moving(void) { servo_moving(); }
+static void b_servo_position(void) { servo_position(); }
+static void b_TWI_submit(void) { bench_TWI_submit(&twi_next_read); }
+static void b_params_set(void) { params_set(0, 30); }
+static void b_imu_data_taken(void) { imu_data_taken(1); }
+
+#define BENCH(name, kind, symbol, setup, run) \
+  static const char name_##run[] PROGMEM = name; \
+  static const char symbol_##run[] PROGMEM = symbol;
+#define BENCHES(X) \
+  X("read_gyro", fn, "read_gyro", nothing, b_read_gyro) \
+  X("read_gyro_raw", fn, "read_gyro_raw", nothing, b_read_gyro_raw) \
+  X("update_gyro_angles", fn, "update_gyro_angles", nothing, b_update_gyro_angles) \
+  X("update_gyro_angles_fx", fn, "update_gyro_angles_fx", nothing, b_update_gyro_angles_fx) \
+  X("update_fused_angles_fifo", fn, "update_fused_angles_fifo", nothing, b_update_fused_angles_fifo) \
+  X("imu_fusion_update", fn, "imu_fusion_update", nothing, b_imu_fusion_update) \
+  X("uart_txU16", fn, "uart_txU16", flush_uart, b_uart_txU16) \
+  X("uart_txFormatted", fn, "tx_formatted", flush_uart, b_uart_txFormatted) \
+  X("uart_txFormatted_q16", fn, "tx_q16", flush_uart, b_uart_txFormatted_q16) \
+  X("vsnprintf_reference", fn, "vfprintf", flush_uart, b_libc_formatted) \
+  X("steering", fn, "heading_update", setup_steering, b_steering) \
+  X("gap_select", fn, "gap_select", setup_gap_select, b_gap_select) \
+  X("INT0_vect", isr, "__vector_1", setup_int0, b_int0) \
+  X("INT1_vect", isr, "__vector_2", nothing, b_int1) \
+  X("TIMER2_OVF_vect", isr, "__vector_9", nothing, b_timer2_ovf) \
+  X("TIMER1_CAPT_vect", isr, "__vector_10", setup_servo_ramp, b_timer1_capt) \
+  X("USART_UDRE_vect", isr, "__vector_19", setup_udre, b_udre) \
+  X("USART_RX_vect", isr, "__vector_18", setup_rx, b_rx) \
+  X("ADC_vect", isr, "__vector_21", setup_adc, b_adc) \
+  X("TWI_vect", isr, "__vector_24", setup_twi, b_twi) \
+  X("micros", cli, "micros", nothing, b_micros) \
+  X("millis", cli, "millis", nothing, b_millis) \
+  X("timebase_ticks", cli, "timebase_ticks", nothing, b_timebase_ticks) \
+  X("US_poll", cli, "US_poll", nothing, b_US_poll) \
+  X("US_get_result", cli, "US_get_result", nothing, b_US_get_result) \
+  X("US_start", cli, "US_start", nothing, b_US_start) \
+  X("set_servo_pulse", cli, "set_servo_pulse", nothing, b_set_servo_pulse) \
+  X("servo_move_to", cli, "servo_move_to", nothing, b_servo_move_to) \
+  X("servo_moving", cli, "servo_moving", nothing, b_servo_moving) \
+  X("servo_position", cli, "servo_position", nothing, b_servo_position) \
+  X("TWI_submit", cli, "bench_TWI_submit", twi_reset, b_TWI_submit) \
+  X("params_set", cli, "params_set", nothing, b_params_set) \
+  X("imu_data_taken", cli, "imu_data_taken", nothing, b_imu_data_taken)
+
+BENCHES(BENCH)
+#undef BENCH
+
+static const char kind_fn[] PROGMEM = "fn";
+static const char kind_isr[] PROGMEM = "isr";
+static const char kind_cli[] PROGMEM = "cli";
+
+#define BENCH(name, kind, symbol, setup, run) { name_##run, kind_##kind, symbol_##run, setup, run },
+
+static const bench_t benches[] PROGMEM = {
+  BENCHES(BENCH)
+};
+
+#undef BENCH
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+//*************** Runner ***************
+
+static uint16_t timing_overhead;
+
+// Cycles taken by one call of run. Interrupts are off throughout
+static uint16_t __attribute__((noinline)) time_call(void (*run)(void))
+{
+  uint16_t start = TCNT1;
+  run();
+  uint16_t end = TCNT1;
+  cli();  // In case it was an ISR
+
+  return end - start;
+}
+
+static void run_bench(const bench_t *b)
+{
+  bench_t bench;
+  uint16_t min = 0xFFFF, max = 0, stack = 0;
+
+  memcpy_P(&bench, b, sizeof(bench));
+
+  for(uint8_t i = 0; i < BENCH_REPEATS; i++) {
+    bench.setup();
+    cli();
+
+    // Paint everything between the end of .bss and just below here
+    uint8_t *sp = (uint8_t*)SP;
+    for(uint8_t *p = &__heap_start; p < sp - STACK_MARGIN; p++)
+      *p = STACK_PAINT;
+
+    TIFR1 = (1 << TOV1);
+    uint16_t cycles = time_call(bench.run) - timing_overhead;
+
+    if(TIFR1 & (1 << TOV1))
+      cycles = 0xFFFF;  // Wrapped at least once: report as over the top of the range
+
+    uint8_t *deepest = &__heap_start;
+    while(deepest < sp && *deepest == STACK_PAINT)
+      deepest++;
+
+    if(cycles < min) min = cycles;
+    if(cycles > max) max = cycles;
+    if(sp - deepest > stack) stack = sp - deepest;
+  }
+
+  console_string_P(PSTR("BENCH "));
+  console_string_P(bench.name);
+  console_char(' ');
+  console_string_P(bench.kind);
+  console_char(' ');
+  console_string_P(bench.symbol);
+  console_char(' ');
+  console_u32(min);
+  console_char(' ');
+  console_u32(max);
+  console_char(' ');
+  console_u32(stack);
+  console_char('\n');
+}
+
+int main(void)
+{
+  // Timer1 free running at F_CPU. Overflows are only checked for, they're never expected
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10);
+
+  uart_init_9600();
+  imu_fusion_init();
+  heading_init(HEADING_GAIN(1.5), HEADING_GAIN(0.02), HEADING_GAIN(4.0));
+
+  cli();
+  timing_overhead = time_call(nothing);
+
+  for(uint8_t i = 0; i < BENCH_COUNT; i++)
+    run_bench(&benches[i]);
+
+  console_string_P(PSTR("BENCH done\n"));
+
+  // simavr stops when the CPU sleeps with interrupts off
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  sleep_enable();
+  cli();
+  sleep_cpu();
+
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include <avr/io.h>
+#include <inttypes.h>
+
+/*
+  The real TWI transaction engine (src/TWI_290.c) for the TWI_vect and TWI_submit benchmarks. The rest
+  of the benchmarks use twi_stub.c, so here every public name is renamed and the three TWI registers it
+  touches are moved into RAM, where bench.c can play a canned status sequence into them. TWCR, TWSR
+  and TWDR are in extended I/O, reached with lds/sts just like RAM, so the cycle counts are the same.
+  TWI_vect itself isn't renamed: twi_stub.c doesn't define it, so this is the handler in the vector table.
+*/
+
+volatile uint8_t bench_twcr, bench_twsr, bench_twdr;
+
+#undef TWCR
+#undef TWSR
+#undef TWDR
+#define TWCR bench_twcr
+#define TWSR bench_twsr
+#define TWDR bench_twdr
+
+#define TWI_start bench_TWI_start
+#define TWI_stop bench_TWI_stop
+#define TWI_write bench_TWI_write
+#define TWI_ack_read bench_TWI_ack_read
+#define TWI_nack_read bench_TWI_nack_read
+#define Read_Reg bench_Read_Reg
+#define Read_Reg_N bench_Read_Reg_N
+#define Write_Reg bench_Write_Reg
+#define TWI_submit bench_TWI_submit
+#define TWI_busy bench_TWI_busy
+#define TWI_wait bench_TWI_wait
+#define flags bench_twi_flags
+#define TWI_status bench_TWI_status
+#define TWI_byte bench_TWI_byte
+
+#include "../src/TWI_290.c"
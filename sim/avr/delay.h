@@ -0,0 +1,10 @@
+#ifndef sim_avr_delay_h
+#define sim_avr_delay_h
+
+#include "../sim.h"
+
+// Delays advance simulated time (interrupts still run, as they would on the chip)
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000.0)
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef sim_avr_eeprom_h
+#define sim_avr_eeprom_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// EEMEM variables are ordinary host variables and stand in for the EEPROM itself. They start zeroed,
+// which the firmware's CRC checks treat as blank
+#define EEMEM
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_write_block(const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v) { *p = v; }
+static inline void eeprom_write_byte(uint8_t *p, uint8_t v) { *p = v; }
+static inline uint8_t eeprom_is_ready(void) { return 1; }
+
+#endif
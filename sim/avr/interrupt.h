@@ -0,0 +1,20 @@
+#ifndef sim_avr_interrupt_h
+#define sim_avr_interrupt_h
+
+#include "io.h"
+
+// Vectors are plain functions. They're declared weak so the simulator can tell which ones exist
+#define ISR(vector, ...) void vector(void)
+
+#define SIM_VECTORS(X) \
+  X(INT0_vect) X(INT1_vect) X(TIMER2_OVF_vect) X(TIMER1_CAPT_vect) X(USART_RX_vect) \
+  X(USART_UDRE_vect) X(ADC_vect) X(TWI_vect)
+
+#define SIM_VECTOR_DECLARE(vector) void vector(void) __attribute__((weak));
+SIM_VECTORS(SIM_VECTOR_DECLARE)
+#undef SIM_VECTOR_DECLARE
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef sim_avr_io_h
+#define sim_avr_io_h
+
+/*
+  Stand-in for <avr/io.h>. Registers are proxy objects, so this header needs the firmware to be
+  compiled as C++ (g++ -x c++); the firmware sources themselves don't change. Only the registers and
+  bits the firmware actually uses are here.
+*/
+#ifndef __cplusplus
+#error "The simulator builds the firmware as C++ so registers can be proxies: compile with g++ -x c++"
+#endif
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>   // avr-libc's <stdio.h> brings this in and the firmware relies on it
+#include "../sim.h"
+
+#define main hovercraft_main   // The simulator has its own main()
+
+struct sim_reg8 {
+  uint8_t id;
+  operator uint8_t() const { return (uint8_t)sim_read(id); }
+  uint8_t operator=(unsigned v) const { sim_write(id, (uint8_t)v); return (uint8_t)v; }
+  uint8_t operator|=(unsigned v) const { return *this = (uint8_t)(sim_read(id) | v); }
+  uint8_t operator&=(unsigned v) const { return *this = (uint8_t)(sim_read(id) & v); }
+  uint8_t operator^=(unsigned v) const { return *this = (uint8_t)(sim_read(id) ^ v); }
+};
+
+struct sim_reg16 {
+  uint8_t id;
+  operator uint16_t() const { return sim_read(id); }
+  uint16_t operator=(unsigned v) const { sim_write(id, (uint16_t)v); return (uint16_t)v; }
+  uint16_t operator|=(unsigned v) const { return *this = (uint16_t)(sim_read(id) | v); }
+  uint16_t operator&=(unsigned v) const { return *this = (uint16_t)(sim_read(id) & v); }
+};
+
+#define SIM_R8(name) (sim_reg8{SIM_##name})
+#define SIM_R16(name) (sim_reg16{SIM_##name})
+
+#define SREG SIM_R8(SREG)
+#define SMCR SIM_R8(SMCR)
+#define PINB SIM_R8(PINB)
+#define DDRB SIM_R8(DDRB)
+#define PORTB SIM_R8(PORTB)
+#define PINC SIM_R8(PINC)
+#define DDRC SIM_R8(DDRC)
+#define PORTC SIM_R8(PORTC)
+#define PIND SIM_R8(PIND)
+#define DDRD SIM_R8(DDRD)
+#define PORTD SIM_R8(PORTD)
+#define EICRA SIM_R8(EICRA)
+#define EIMSK SIM_R8(EIMSK)
+#define EIFR SIM_R8(EIFR)
+#define TCCR0A SIM_R8(TCCR0A)
+#define TCCR0B SIM_R8(TCCR0B)
+#define TCNT0 SIM_R8(TCNT0)
+#define OCR0A SIM_R8(OCR0A)
+#define OCR0B SIM_R8(OCR0B)
+#define TIMSK0 SIM_R8(TIMSK0)
+#define TIFR0 SIM_R8(TIFR0)
+#define TCCR1A SIM_R8(TCCR1A)
+#define TCCR1B SIM_R8(TCCR1B)
+#define TCCR1C SIM_R8(TCCR1C)
+#define TCNT1 SIM_R16(TCNT1)
+#define OCR1A SIM_R16(OCR1A)
+#define OCR1B SIM_R16(OCR1B)
+#define ICR1 SIM_R16(ICR1)
+#define TIMSK1 SIM_R8(TIMSK1)
+#define TIFR1 SIM_R8(TIFR1)
+#define TCCR2A SIM_R8(TCCR2A)
+#define TCCR2B SIM_R8(TCCR2B)
+#define TCNT2 SIM_R8(TCNT2)
+#define OCR2A SIM_R8(OCR2A)
+#define OCR2B SIM_R8(OCR2B)
+#define TIMSK2 SIM_R8(TIMSK2)
+#define TIFR2 SIM_R8(TIFR2)
+#define ADMUX SIM_R8(ADMUX)
+#define ADCSRA SIM_R8(ADCSRA)
+#define ADCSRB SIM_R8(ADCSRB)
+#define ADCL SIM_R8(ADCL)
+#define ADCH SIM_R8(ADCH)
+#define ADC SIM_R16(ADC)
+#define ADCW ADC
+#define DIDR0 SIM_R8(DIDR0)
+#define TWBR SIM_R8(TWBR)
+#define TWSR SIM_R8(TWSR)
+#define TWAR SIM_R8(TWAR)
+#define TWDR SIM_R8(TWDR)
+#define TWCR SIM_R8(TWCR)
+#define UCSR0A SIM_R8(UCSR0A)
+#define UCSR0B SIM_R8(UCSR0B)
+#define UCSR0C SIM_R8(UCSR0C)
+#define UBRR0L SIM_R8(UBRR0L)
+#define UBRR0H SIM_R8(UBRR0H)
+#define UDR0 SIM_R8(UDR0)
+
+// SREG
+#define SREG_I 7
+
+// SMCR
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+
+// Port pins
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD5 5
+#define PORTD6 6
+#define DDB1 1
+#define DDB3 3
+#define DDD5 5
+#define DDD6 6
+
+// External interrupts
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define INT0 0
+#define INT1 1
+#define INTF0 0
+#define INTF1 1
+
+// Timer0
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+
+// Timer1
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+// Timer2
+#define WGM20 0
+#define WGM21 1
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+
+// ADC
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ADC0D 0
+
+// TWI
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+#define TWPS0 0
+#define TWPS1 1
+
+// USART0
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef sim_avr_pgmspace_h
+#define sim_avr_pgmspace_h
+
+#include <stdint.h>
+#include <string.h>
+
+// One address space on the host, so flash reads are ordinary reads
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t*)(addr))
+#define pgm_read_ptr(addr) (*(void* const*)(addr))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strlen_P strlen
+#define strcpy_P strcpy
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef sim_avr_sleep_h
+#define sim_avr_sleep_h
+
+#include "io.h"
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_enable() ((void)0)
+#define sleep_disable() ((void)0)
+#define sleep_cpu() sim_sleep()
+#define sleep_mode() sim_sleep()
+
+#endif
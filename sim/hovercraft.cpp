@@ -0,0 +1,310 @@
+#include "sim.h"
+#include "hovercraft.h"
+#include "avr/io.h"
+#include "convert.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+  The craft and the course. Planar rigid body, 1ms steps:
+    - Thrust comes from OCR0A (proportional to duty) and acts through the servo, which turns the
+      fan: in the body frame Fx = T cos(d), Fy = -T sin(d), yaw torque = arm * T * sin(d). A positive
+      servo heading therefore turns the craft left, as on the real thing.
+    - With the lift fan (OCR0B) below LIFT_HOVER_DUTY the skirt touches down and friction stops it.
+    - Linear drag, heavier sideways than forwards; yaw damping.
+    - Walls are segments, the hull is a circle. Contact pushes the craft back out and takes most of the
+      speed into the wall away. Every new contact is counted as a collision.
+  The ultrasonic sensor turns with the servo. A measurement is the nearest wall along three rays across
+  the beam, ignoring walls hit at a shallow angle (the sound reflects away from the sensor). The IR
+  sensor looks straight up and sees the end bar when the craft's centre is under it.
+  Units: cm, degrees, seconds. Angles are counter-clockwise, so yaw and the MPU's z rate agree.
+*/
+
+#define CRAFT_STEP SIM_MS(1)
+#define CRAFT_DT 0.001f
+
+#define HULL_RADIUS 15.0f         // cm
+#define MASS 1.2f                 // kg
+#define INERTIA 0.03f             // kg m^2
+#define ARM 0.20f                 // m, thrust fan to centre of mass
+#define THRUST_MAX 1.2f           // N at OCR0A = 255
+#define LIFT_HOVER_DUTY 200       // OCR0B needed to stay up
+#define DRAG_FORWARD 0.8f         // N per m/s
+#define DRAG_SIDEWAYS 1.2f
+#define YAW_DAMPING 0.05f         // N m per rad/s
+#define GROUND_TIME 0.1f          // s, how fast friction stops a grounded craft
+#define WALL_RESTITUTION 0.2f
+#define SERVO_SLEW 300.0f         // deg/s
+
+#define US_BEAM_HALF 7.5f         // deg
+#define US_MAX_RANGE 400.0f       // cm
+#define US_MAX_INCIDENCE 70.0f    // deg from the wall's normal
+#define US_RESPONSE SIM_US(450)   // Trigger to start of echo
+#define US_NO_ECHO SIM_MS(38)     // Echo length with nothing in range
+#define US_CM SIM_US(58)          // Echo length per cm
+
+#define IR_BAR_RADIUS 8.0f        // cm either side of the bar that still counts as under it
+#define IR_BAR_READING 57         // ADCH
+#define IR_FLOOR_READING 10
+
+#define DEG (3.14159265f / 180)
+
+struct segment {
+  float x1, y1, x2, y2;
+  uint8_t touching;
+};
+
+static std::vector<segment> walls, bars;
+static craft_state_t craft;
+static float servo_heading = 0;   // Where the fan and sensor are actually pointing
+static float accel_body[2];       // m/s^2, for the accelerometer
+static uint64_t step_due;
+static uint64_t echo_fall_at;
+static uint8_t echo_busy = 0;
+
+const craft_state_t *craft_state(void)
+{
+  return &craft;
+}
+
+uint8_t craft_load(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char line[128];
+
+  if(!f)
+    return 1;
+
+  while(fgets(line, sizeof(line), f)) {
+    segment s = {0, 0, 0, 0, 0};
+    float x, y, heading;
+
+    if(sscanf(line, "wall %f %f %f %f", &s.x1, &s.y1, &s.x2, &s.y2) == 4)
+      walls.push_back(s);
+    else if(sscanf(line, "bar %f %f %f %f", &s.x1, &s.y1, &s.x2, &s.y2) == 4)
+      bars.push_back(s);
+    else if(sscanf(line, "start %f %f %f", &x, &y, &heading) == 3) {
+      craft.x = x;
+      craft.y = y;
+      craft.heading = heading;
+    }
+  }
+
+  fclose(f);
+  return walls.empty();
+}
+
+// Closest point on a segment to (x, y). Returns the distance
+static float nearest(const segment &s, float x, float y, float *px, float *py)
+{
+  float dx = s.x2 - s.x1, dy = s.y2 - s.y1;
+  float length2 = dx * dx + dy * dy;
+  float t = length2 > 0 ? ((x - s.x1) * dx + (y - s.y1) * dy) / length2 : 0;
+
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  *px = s.x1 + t * dx;
+  *py = s.y1 + t * dy;
+
+  return hypotf(x - *px, y - *py);
+}
+
+static uint8_t under_bar(void)
+{
+  float px, py;
+
+  for(const segment &b : bars)
+    if(nearest(b, craft.x, craft.y, &px, &py) < IR_BAR_RADIUS)
+      return 1;
+
+  return 0;
+}
+
+static void collide(void)
+{
+  for(segment &w : walls) {
+    float px, py;
+    float distance = nearest(w, craft.x, craft.y, &px, &py);
+
+    if(distance >= HULL_RADIUS || distance == 0) {
+      if(distance > HULL_RADIUS + 1)
+        w.touching = 0;  // A little hysteresis, so sliding along a wall is one collision
+      continue;
+    }
+
+    float nx = (craft.x - px) / distance, ny = (craft.y - py) / distance;
+    float vn = craft.vx * nx + craft.vy * ny;
+
+    craft.x = px + nx * HULL_RADIUS;
+    craft.y = py + ny * HULL_RADIUS;
+
+    if(vn < 0) {
+      craft.vx -= (1 + WALL_RESTITUTION) * vn * nx;
+      craft.vy -= (1 + WALL_RESTITUTION) * vn * ny;
+    }
+
+    if(!w.touching)
+      craft.collisions++;
+    w.touching = 1;
+  }
+}
+
+static void step(void)
+{
+  if(sim_event_at != step_due)
+    return;
+  step_due += CRAFT_STEP;
+  sim_schedule(step, step_due);
+
+  // Servo, only while Timer1 is producing pulses
+  if(sim_regs[SIM_TCCR1B] & 7) {
+    float target = servo_pulse_to_heading(sim_regs[SIM_OCR1A]);
+    float slew = SERVO_SLEW * CRAFT_DT;
+    float error = target - servo_heading;
+
+    servo_heading += (error > slew) ? slew : (error < -slew ? -slew : error);
+  }
+
+  uint8_t fans_on = (sim_regs[SIM_TCCR0B] & 7) != 0;
+  float duty = fans_on ? sim_regs[SIM_OCR0A] / 255.0f : 0;
+  float thrust = THRUST_MAX * duty;
+  float c = cosf(craft.heading * DEG), s = sinf(craft.heading * DEG);
+  float d = servo_heading * DEG;
+
+  // Body frame velocity (m/s) and forces (N)
+  float u = (craft.vx * c + craft.vy * s) / 100, v = (-craft.vx * s + craft.vy * c) / 100;
+  float fx = thrust * cosf(d) - DRAG_FORWARD * u;
+  float fy = -thrust * sinf(d) - DRAG_SIDEWAYS * v;
+  float r = craft.yaw_rate * DEG;
+  float torque = ARM * thrust * sinf(d) - YAW_DAMPING * r;
+
+  craft.grounded = !fans_on || sim_regs[SIM_OCR0B] < LIFT_HOVER_DUTY;
+
+  if(craft.grounded) {
+    float decay = expf(-CRAFT_DT / GROUND_TIME);
+    u *= decay;
+    v *= decay;
+    r *= decay;
+    accel_body[0] = accel_body[1] = 0;
+  } else {
+    accel_body[0] = fx / MASS;
+    accel_body[1] = fy / MASS;
+    u += accel_body[0] * CRAFT_DT;
+    v += accel_body[1] * CRAFT_DT;
+    r += torque / INERTIA * CRAFT_DT;
+  }
+
+  craft.vx = (u * c - v * s) * 100;
+  craft.vy = (u * s + v * c) * 100;
+  craft.yaw_rate = r / DEG;
+  craft.heading += craft.yaw_rate * CRAFT_DT;
+
+  float x = craft.x, y = craft.y;
+  craft.x += craft.vx * CRAFT_DT;
+  craft.y += craft.vy * CRAFT_DT;
+  collide();
+  craft.distance += hypotf(craft.x - x, craft.y - y);
+
+  if(under_bar())
+    craft.reached_bar = 1;
+}
+
+void craft_init(void)
+{
+  step_due = sim_cycles + CRAFT_STEP;
+  sim_schedule(step, step_due);
+}
+
+void craft_imu(float gyro_dps[3], float accel_g[3])
+{
+  gyro_dps[0] = gyro_dps[1] = 0;
+  gyro_dps[2] = craft.yaw_rate;
+
+  accel_g[0] = accel_body[0] / 9.81f;
+  accel_g[1] = accel_body[1] / 9.81f;
+  accel_g[2] = 1;
+}
+
+//*************** Ultrasonic ***************
+
+// Distance along a ray to the nearest wall that would echo back, or US_MAX_RANGE
+static float ray_cast(float angle)
+{
+  float dx = cosf(angle * DEG), dy = sinf(angle * DEG);
+  float best = US_MAX_RANGE;
+
+  for(const segment &w : walls) {
+    float ex = w.x2 - w.x1, ey = w.y2 - w.y1;
+    float denom = dx * ey - dy * ex;
+
+    if(fabsf(denom) < 1e-6f)
+      continue; // Parallel
+
+    float t = ((w.x1 - craft.x) * ey - (w.y1 - craft.y) * ex) / denom;   // Along the ray
+    float u = ((w.x1 - craft.x) * dy - (w.y1 - craft.y) * dx) / denom;   // Along the wall
+
+    if(t <= 0 || u < 0 || u > 1 || t >= best)
+      continue;
+
+    // Angle between the ray and the wall's normal
+    float incidence = acosf(fabsf(denom) / hypotf(ex, ey)) / DEG;
+    if(incidence > US_MAX_INCIDENCE)
+      continue;
+
+    best = t;
+  }
+
+  return best;
+}
+
+static void echo_fall(void)
+{
+  if(sim_event_at != echo_fall_at)
+    return;
+
+  sim_set_echo(0);
+  echo_busy = 0;
+}
+
+static void echo_rise(void)
+{
+  float direction = craft.heading + servo_heading;
+  float distance = US_MAX_RANGE;
+
+  for(int8_t i = -1; i <= 1; i++) {
+    float d = ray_cast(direction + i * US_BEAM_HALF);
+    if(d < distance)
+      distance = d;
+  }
+
+  sim_set_echo(1);
+
+  if(distance < US_MAX_RANGE)
+    echo_fall_at = sim_cycles + (uint64_t)((distance + (rand() / (float)RAND_MAX - 0.5f)) * US_CM);
+  else
+    echo_fall_at = sim_cycles + US_NO_ECHO;
+  sim_schedule(echo_fall, echo_fall_at);
+}
+
+void craft_trigger(void)
+{
+  if(echo_busy)
+    return; // The sensor ignores triggers until it has finished the last measurement
+
+  echo_busy = 1;
+  sim_schedule(echo_rise, sim_cycles + US_RESPONSE);
+}
+
+//*************** IR ***************
+
+uint16_t craft_adc(uint8_t channel)
+{
+  if(channel != 0)
+    return 0;
+
+  uint16_t reading = under_bar() ? IR_BAR_READING : IR_FLOOR_READING;
+
+  return (reading << 2) + rand() % 8;  // 10 bits, a couple of counts of noise
+}
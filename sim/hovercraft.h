@@ -0,0 +1,22 @@
+#ifndef hovercraft_h
+#define hovercraft_h
+
+#include <stdint.h>
+
+// The craft model in hovercraft.cpp. Positions in cm, angles in degrees (counter-clockwise)
+typedef struct {
+  float x, y, heading;
+  float vx, vy, yaw_rate;
+  float distance;                 // Travelled, cm
+  uint16_t collisions;            // Separate wall contacts
+  uint8_t grounded;               // Lift fan too slow to hover
+  uint8_t reached_bar;            // Passed under the end bar at some point
+} craft_state_t;
+
+uint8_t craft_load(const char *path);   // Read walls, the bar and the start pose. Returns 1 on failure
+
+void craft_init(void);                  // Start the dynamics. Call before sim_run()
+
+const craft_state_t *craft_state(void);
+
+#endif
@@ -0,0 +1,243 @@
+#include "sim.h"
+#include "hovercraft.h"
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+
+// Build (from the repository root). The firmware is C, so C++20's deprecation of ++ and -- on volatiles
+// doesn't apply to it:
+//   g++ -std=gnu++20 -O2 -Wall -Wno-volatile -Isim -Isrc -x c++ src/*.c -x none sim/*.cpp -o sim/hover_sim
+
+/*
+  Closed-loop hovercraft simulator. Runs the unmodified firmware from src/ against the MCU, MPU-6050 and
+  craft models, many times with different seeds, and prints one CSV line per run.
+
+  Usage:
+    sim/hover_sim [--course FILE] [--runs N] [--jobs N] [--seed S] [--time SECONDS]
+                  [--set name=value]... [--send TEXT] [--uart FILE]
+
+  --set changes a parameter (params.h) before the firmware starts, the same as "set" + "save" on the
+  console. --send types TEXT (plus a newline) into the UART two seconds after reset, once the firmware
+  is past calibration. --uart writes what the firmware transmits to FILE (FILE.<run> with more than one
+  run); decode it with tools/telemetry_decode.
+
+  Every run is a fresh process, so the firmware's statics and the EEPROM start from scratch each time.
+*/
+
+#define DEFAULT_COURSE "sim/courses/default.course"
+#define SEND_AT_MS 2000     // --send text goes out once the firmware is past calibration
+
+typedef struct {
+  uint32_t run, seed;
+  uint8_t returned;               // The firmware's main() returned (it thinks it reached the end)
+  uint8_t crashed;
+  float time_s;
+  craft_state_t craft;
+} run_result_t;
+
+static const char *course = DEFAULT_COURSE;
+static uint32_t runs = 1, jobs = 1, seed = 1;
+static double time_limit = 120;
+static std::vector<std::string> settings;
+static const char *send_text = 0;
+static const char *uart_path = 0;
+static FILE *uart_file = 0;
+
+static void uart_to_file(uint8_t c)
+{
+  fputc(c, uart_file);
+}
+
+static void apply_settings(void)
+{
+  params_init();
+
+  for(const std::string &s : settings) {
+    size_t eq = s.find('=');
+    std::string name = s.substr(0, eq);
+    int8_t index = params_find(name.c_str());
+
+    if(eq == std::string::npos || index < 0 || params_set(index, strtol(s.c_str() + eq + 1, 0, 0))) {
+      fprintf(stderr, "hover_sim: can't set %s\n", s.c_str());
+      exit(1);
+    }
+  }
+
+  params_save();
+  while(params_save_step());
+}
+
+// All at once, as if pasted: the UART model delivers the characters back to back at the baud rate
+static void send(void)
+{
+  for(const char *p = send_text; *p; p++)
+    sim_uart_rx(*p);
+  sim_uart_rx('\n');
+}
+
+// Runs in the child process
+static run_result_t run_once(uint32_t run)
+{
+  run_result_t result;
+
+  memset(&result, 0, sizeof(result));
+  result.run = run;
+  result.seed = seed + run;
+  srand(result.seed);
+
+  if(craft_load(course)) {
+    fprintf(stderr, "hover_sim: can't load course %s\n", course);
+    exit(1);
+  }
+
+  if(uart_path) {
+    char path[256];
+    if(runs > 1)
+      snprintf(path, sizeof(path), "%s.%u", uart_path, run);
+    else
+      snprintf(path, sizeof(path), "%s", uart_path);
+    uart_file = fopen(path, "wb");
+    if(uart_file)
+      sim_uart_output(uart_to_file);
+  }
+
+  if(!settings.empty())
+    apply_settings();
+
+  if(send_text)
+    sim_schedule(send, SIM_MS(SEND_AT_MS));
+
+  craft_init();
+  result.returned = sim_run(SIM_MS((uint64_t)(time_limit * 1000)));
+  result.time_s = sim_cycles / (double)SIM_F_CPU;
+  result.craft = *craft_state();
+
+  if(uart_file)
+    fclose(uart_file);
+
+  return result;
+}
+
+static const char *outcome(const run_result_t *r)
+{
+  if(r->crashed)
+    return "crashed";
+  if(!r->returned)
+    return "timeout";
+  return r->craft.reached_bar ? "finished" : "stopped_early";
+}
+
+struct child {
+  pid_t pid;
+  int fd;
+  uint32_t run;
+};
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: hover_sim [--course FILE] [--runs N] [--jobs N] [--seed S] [--time SECONDS]\n"
+                  "                 [--set name=value]... [--send TEXT] [--uart FILE]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = (i + 1 < argc) ? argv[i + 1] : 0;
+
+    if(!value)
+      usage();
+    i++;
+
+    if(!strcmp(arg, "--course")) course = value;
+    else if(!strcmp(arg, "--runs")) runs = strtoul(value, 0, 0);
+    else if(!strcmp(arg, "--jobs")) jobs = strtoul(value, 0, 0);
+    else if(!strcmp(arg, "--seed")) seed = strtoul(value, 0, 0);
+    else if(!strcmp(arg, "--time")) time_limit = atof(value);
+    else if(!strcmp(arg, "--set")) settings.push_back(value);
+    else if(!strcmp(arg, "--send")) send_text = value;
+    else if(!strcmp(arg, "--uart")) uart_path = value;
+    else usage();
+  }
+
+  if(jobs < 1)
+    jobs = 1;
+
+  std::vector<run_result_t> results(runs);
+  std::vector<child> children;
+  uint32_t next = 0;
+
+  fflush(stdout);
+
+  while(next < runs || !children.empty()) {
+    while(next < runs && children.size() < jobs) {
+      int fds[2];
+      if(pipe(fds)) {
+        perror("pipe");
+        return 1;
+      }
+
+      pid_t pid = fork();
+      if(pid == 0) {
+        close(fds[0]);
+        run_result_t r = run_once(next);
+        if(write(fds[1], &r, sizeof(r)) != sizeof(r))
+          _exit(1);
+        _exit(0);
+      }
+
+      close(fds[1]);
+      children.push_back(child{pid, fds[0], next});
+      next++;
+    }
+
+    // Collect whichever child finishes first
+    int status;
+    pid_t pid = wait(&status);
+
+    for(size_t i = 0; i < children.size(); i++) {
+      if(children[i].pid != pid)
+        continue;
+
+      run_result_t *r = &results[children[i].run];
+      if(read(children[i].fd, r, sizeof(*r)) != sizeof(*r)) {
+        memset(r, 0, sizeof(*r));
+        r->run = children[i].run;
+        r->seed = seed + children[i].run;
+        r->crashed = 1;
+      }
+
+      close(children[i].fd);
+      children.erase(children.begin() + i);
+      break;
+    }
+  }
+
+  uint32_t finished = 0, collisions = 0;
+  double finish_time = 0;
+
+  printf("run,seed,outcome,time_s,collisions,distance_cm,x_cm,y_cm\n");
+  for(const run_result_t &r : results) {
+    printf("%u,%u,%s,%.2f,%u,%.0f,%.0f,%.0f\n", r.run, r.seed, outcome(&r), r.time_s, r.craft.collisions,
+           r.craft.distance, r.craft.x, r.craft.y);
+
+    collisions += r.craft.collisions;
+    if(!strcmp(outcome(&r), "finished")) {
+      finished++;
+      finish_time += r.time_s;
+    }
+  }
+
+  fprintf(stderr, "%u/%u finished", finished, runs);
+  if(finished)
+    fprintf(stderr, ", mean time %.1fs", finish_time / finished);
+  fprintf(stderr, ", %u collisions\n", collisions);
+
+  return finished == runs ? 0 : 1;
+}
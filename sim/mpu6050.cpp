@@ -0,0 +1,238 @@
+#include "sim.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  MPU-6050 on the TWI bus at 0x68: the register file, sampling at SMPLRT_DIV, the 1024 byte FIFO with
+  its overflow flag, INT_STATUS and a 50us data-ready pulse on INT. Readings are the craft's true motion
+  plus white noise and a constant gyro bias that is different every run (that's what calibration and
+  fusion have to get rid of).
+*/
+
+#define MPU_ADDRESS 0x68
+#define MPU_SMPLRT_DIV 0x19
+#define MPU_CONFIG 0x1A
+#define MPU_GYRO_CONFIG 0x1B
+#define MPU_ACCEL_CONFIG 0x1C
+#define MPU_FIFO_EN 0x23
+#define MPU_INT_ENABLE 0x38
+#define MPU_INT_STATUS 0x3A
+#define MPU_ACCEL_XOUT_H 0x3B
+#define MPU_USER_CTRL 0x6A
+#define MPU_PWR_MGMT_1 0x6B
+#define MPU_FIFO_COUNTH 0x72
+#define MPU_FIFO_COUNTL 0x73
+#define MPU_FIFO_R_W 0x74
+#define MPU_WHO_AM_I 0x75
+
+#define MPU_FIFO_SIZE 1024
+#define MPU_INT_PULSE SIM_US(50)
+
+#define GYRO_NOISE_DPS 0.05f    // Per sample, roughly what the datasheet's noise density gives at 44Hz
+#define ACCEL_NOISE_G 0.004f
+#define GYRO_BIAS_DPS 2.0f      // Bias is drawn from +-this for each axis
+#define TEMPERATURE_C 25.0f
+
+float mpu_gyro_bias[3];
+
+static uint8_t regs[128];
+static uint8_t pointer;         // Register the next read or write goes to
+static uint8_t first_write;     // Next byte written is the register pointer
+static uint8_t fifo[MPU_FIFO_SIZE];
+static uint16_t fifo_head, fifo_count;
+static uint64_t sample_due = 0;
+
+static float noise(float amplitude)
+{
+  // Sum of uniforms is close enough to Gaussian here
+  float sum = 0;
+  for(uint8_t i = 0; i < 4; i++)
+    sum += rand() / (float)RAND_MAX - 0.5f;
+  return sum * amplitude * 1.732f;
+}
+
+static int16_t saturate(float value)
+{
+  if(value > 32767)
+    return 32767;
+  if(value < -32768)
+    return -32768;
+  return (int16_t)lrintf(value);
+}
+
+static void put16(uint8_t reg, int16_t value)
+{
+  regs[reg] = (uint16_t)value >> 8;
+  regs[reg + 1] = value & 0xFF;
+}
+
+static void fifo_push(uint8_t byte)
+{
+  if(fifo_count == MPU_FIFO_SIZE) {
+    fifo_head = (fifo_head + 1) % MPU_FIFO_SIZE;  // Full: the oldest byte is overwritten
+    fifo_count--;
+    regs[MPU_INT_STATUS] |= 0x10;                  // FIFO_OFLOW_INT
+  }
+
+  fifo[(fifo_head + fifo_count++) % MPU_FIFO_SIZE] = byte;
+}
+
+static uint8_t fifo_pop(void)
+{
+  if(fifo_count == 0)
+    return 0;
+
+  uint8_t byte = fifo[fifo_head];
+  fifo_head = (fifo_head + 1) % MPU_FIFO_SIZE;
+  fifo_count--;
+  return byte;
+}
+
+static void int_release(void)
+{
+  sim_set_imu_int(0);
+}
+
+static void sample(void);
+
+// The gyro runs at 1kHz with the DLPF on (CONFIG 1-6) and 8kHz with it off; SMPLRT_DIV divides that
+static void schedule_sample(uint64_t from)
+{
+  uint8_t dlpf = regs[MPU_CONFIG] & 7;
+  uint64_t base = (dlpf == 0 || dlpf == 7) ? SIM_US(125) : SIM_US(1000);
+
+  sample_due = from + base * (1 + regs[MPU_SMPLRT_DIV]);
+  sim_schedule(sample, sample_due);
+}
+
+static void sample(void)
+{
+  if(sim_event_at != sample_due)
+    return;
+
+  schedule_sample(sample_due);
+
+  if(regs[MPU_PWR_MGMT_1] & 0x40)
+    return; // Asleep
+
+  float gyro[3], accel[3];
+  craft_imu(gyro, accel);
+
+  float gyro_lsb = 131.0f / (1 << ((regs[MPU_GYRO_CONFIG] >> 3) & 3));
+  float accel_lsb = 16384.0f / (1 << ((regs[MPU_ACCEL_CONFIG] >> 3) & 3));
+
+  for(uint8_t i = 0; i < 3; i++) {
+    put16(MPU_ACCEL_XOUT_H + 2 * i, saturate((accel[i] + noise(ACCEL_NOISE_G)) * accel_lsb));
+    put16(MPU_ACCEL_XOUT_H + 8 + 2 * i, saturate((gyro[i] + mpu_gyro_bias[i] + noise(GYRO_NOISE_DPS)) * gyro_lsb));
+  }
+  put16(MPU_ACCEL_XOUT_H + 6, saturate((TEMPERATURE_C - 36.53f) * 340));
+
+  if(regs[MPU_USER_CTRL] & 0x40) {
+    // FIFO order: accel, temp, gyro x, y, z, each only if enabled in FIFO_EN
+    uint8_t enable = regs[MPU_FIFO_EN];
+    static const uint8_t bits[] = {0x08, 0x08, 0x08, 0x80, 0x40, 0x20, 0x10};
+
+    for(uint8_t i = 0; i < 7; i++) {
+      if(enable & bits[i]) {
+        fifo_push(regs[MPU_ACCEL_XOUT_H + 2 * i]);
+        fifo_push(regs[MPU_ACCEL_XOUT_H + 2 * i + 1]);
+      }
+    }
+  }
+
+  regs[MPU_INT_STATUS] |= 0x01; // DATA_RDY_INT
+
+  if(regs[MPU_INT_ENABLE] & 0x01) {
+    sim_set_imu_int(1);
+    sim_schedule(int_release, sim_cycles + MPU_INT_PULSE);
+  }
+}
+
+void mpu_reset(void)
+{
+  memset(regs, 0, sizeof(regs));
+  regs[MPU_PWR_MGMT_1] = 0x40;  // Starts asleep
+  regs[MPU_WHO_AM_I] = MPU_ADDRESS;
+  fifo_head = fifo_count = 0;
+
+  for(uint8_t i = 0; i < 3; i++)
+    mpu_gyro_bias[i] = (2 * (rand() / (float)RAND_MAX) - 1) * GYRO_BIAS_DPS;
+
+  schedule_sample(sim_cycles);
+}
+
+uint8_t mpu_twi_start(uint8_t address, uint8_t read)
+{
+  first_write = !read;
+  return address == MPU_ADDRESS;
+}
+
+void mpu_twi_write(uint8_t data)
+{
+  if(first_write) {
+    pointer = data & 0x7F;
+    first_write = 0;
+    return;
+  }
+
+  switch(pointer) {
+    case MPU_USER_CTRL:
+      if(data & 0x04)
+        fifo_head = fifo_count = 0;  // FIFO_RESET clears itself
+      data &= ~0x07;
+      break;
+
+    case MPU_PWR_MGMT_1:
+      if(data & 0x80) {
+        mpu_reset();                 // DEVICE_RESET
+        return;
+      }
+      break;
+
+    case MPU_FIFO_R_W:
+      fifo_push(data);
+      return;
+
+    case MPU_INT_STATUS:
+    case MPU_WHO_AM_I:
+      pointer++;
+      return; // Read only
+  }
+
+  regs[pointer] = data;
+  pointer = (pointer + 1) & 0x7F;
+}
+
+uint8_t mpu_twi_read(void)
+{
+  uint8_t value;
+
+  switch(pointer) {
+    case MPU_FIFO_R_W:
+      return fifo_pop();  // Doesn't advance the pointer, so a burst keeps popping
+
+    case MPU_FIFO_COUNTH:
+      value = fifo_count >> 8;
+      break;
+
+    case MPU_FIFO_COUNTL:
+      value = fifo_count & 0xFF;
+      break;
+
+    case MPU_INT_STATUS:
+      value = regs[MPU_INT_STATUS];
+      regs[MPU_INT_STATUS] = 0;  // Cleared by reading
+      break;
+
+    default:
+      value = regs[pointer];
+  }
+
+  pointer = (pointer + 1) & 0x7F;
+  return value;
+}
+
+void mpu_twi_stop(void)
+{
+}
@@ -0,0 +1,75 @@
+#ifndef sim_h
+#define sim_h
+
+#include <stdint.h>
+
+/*
+  Host simulator core. The firmware in src/ is compiled unchanged against the fake AVR headers in
+  this directory. Every register is a small proxy object, so each read and write lands in
+  sim_read()/sim_write(), which advance simulated time, run the peripheral models and dispatch
+  interrupts. Time only moves when the firmware touches a register, sleeps or delays, so pure
+  computation is free. That is fine for checking behaviour, not for measuring how long code takes.
+*/
+
+#define SIM_F_CPU 16000000ULL
+#define SIM_US(us) ((uint64_t)(us) * (SIM_F_CPU / 1000000))  // Microseconds to cycles
+#define SIM_MS(ms) SIM_US((uint64_t)(ms) * 1000)
+#define SIM_ACCESS_CYCLES 4     // What one register access costs in simulated time
+
+enum sim_reg_id {
+  SIM_SREG, SIM_SMCR,
+  SIM_PINB, SIM_DDRB, SIM_PORTB, SIM_PINC, SIM_DDRC, SIM_PORTC, SIM_PIND, SIM_DDRD, SIM_PORTD,
+  SIM_EICRA, SIM_EIMSK, SIM_EIFR,
+  SIM_TCCR0A, SIM_TCCR0B, SIM_TCNT0, SIM_OCR0A, SIM_OCR0B, SIM_TIMSK0, SIM_TIFR0,
+  SIM_TCCR1A, SIM_TCCR1B, SIM_TCCR1C, SIM_TCNT1, SIM_OCR1A, SIM_OCR1B, SIM_ICR1, SIM_TIMSK1, SIM_TIFR1,
+  SIM_TCCR2A, SIM_TCCR2B, SIM_TCNT2, SIM_OCR2A, SIM_OCR2B, SIM_TIMSK2, SIM_TIFR2,
+  SIM_ADMUX, SIM_ADCSRA, SIM_ADCSRB, SIM_ADCL, SIM_ADCH, SIM_ADC, SIM_DIDR0,
+  SIM_TWBR, SIM_TWSR, SIM_TWAR, SIM_TWDR, SIM_TWCR,
+  SIM_UCSR0A, SIM_UCSR0B, SIM_UCSR0C, SIM_UBRR0L, SIM_UBRR0H, SIM_UDR0,
+  SIM_REG_COUNT
+};
+
+// Peripheral models call these
+extern uint64_t sim_cycles;                   // Simulated time since reset
+extern uint16_t sim_regs[SIM_REG_COUNT];      // Backing store for registers without special behaviour
+
+uint16_t sim_read(uint8_t id);
+void sim_write(uint8_t id, uint16_t value);
+
+void sim_cli(void);
+void sim_sei(void);
+void sim_sleep(void);                         // Run until the next interrupt
+void sim_delay_us(double us);
+
+// Pins driven from outside the MCU
+void sim_set_echo(uint8_t level);             // PD2 / INT0
+void sim_set_imu_int(uint8_t level);          // PD3 / INT1
+void sim_uart_rx(uint8_t c);                  // Queue a received character
+
+// Things that happen at a fixed time. Peripherals schedule themselves with sim_schedule. Events
+// can't be cancelled: a peripheral checks sim_event_at against the time it's expecting instead
+typedef void (*sim_event_fn)(void);
+extern uint64_t sim_event_at;
+void sim_schedule(sim_event_fn fn, uint64_t at);
+
+// Hooks the models provide (hovercraft.cpp, mpu6050.cpp)
+void mpu_reset(void);
+uint8_t mpu_twi_start(uint8_t address, uint8_t read);  // Returns 1 if the address was acknowledged
+void mpu_twi_write(uint8_t data);
+uint8_t mpu_twi_read(void);
+void mpu_twi_stop(void);
+
+void craft_trigger(void);                     // Ultrasonic trigger pulse finished
+void craft_imu(float gyro_dps[3], float accel_g[3]);  // Body rates and specific force, MPU axes
+uint16_t craft_adc(uint8_t channel);          // 10-bit ADC reading
+
+// The firmware's main(), renamed by the fake <avr/io.h>
+int hovercraft_main(void);
+
+// Run the firmware until it returns or stop_at is reached. Returns 1 if it returned by itself
+uint8_t sim_run(uint64_t stop_at);
+
+// Where the UART output goes (nothing by default)
+void sim_uart_output(void (*sink)(uint8_t c));
+
+#endif
@@ -0,0 +1,633 @@
+#include "sim.h"
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "util/twi.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <queue>
+#include <deque>
+#include <vector>
+
+/*
+  The ATmega328P as the firmware uses it: time, interrupts, Timer1/Timer2 interrupts, the TWI master,
+  the USART, the ADC and the two external interrupts. Timer0 is only PWM, so the craft model reads
+  OCR0A/OCR0B straight out of sim_regs.
+
+  Peripherals schedule an event for the next thing they'll do. An event only acts if it is still the
+  one the peripheral is waiting for (its time matches the peripheral's due time), so rescheduling never
+  has to remove anything from the queue.
+*/
+
+uint64_t sim_cycles = 0;
+uint16_t sim_regs[SIM_REG_COUNT];
+
+static uint64_t stop_at = UINT64_MAX;
+static jmp_buf stop_jump;
+static uint8_t in_isr = 0;
+static uint32_t isr_count = 0;      // Interrupts serviced so far, so sleep knows when to wake
+uint64_t sim_event_at;              // Time the running event was scheduled for
+
+struct sim_event {
+  uint64_t at;
+  uint64_t seq;                     // Keeps events at the same time in the order they were scheduled
+  sim_event_fn fn;
+  bool operator<(const sim_event &e) const { return at != e.at ? at > e.at : seq > e.seq; }
+};
+
+static std::priority_queue<sim_event> events;
+static uint64_t event_seq = 0;
+
+void sim_schedule(sim_event_fn fn, uint64_t at)
+{
+  events.push(sim_event{at, event_seq++, fn});
+}
+
+#define BIT(reg, bit) (sim_regs[SIM_##reg] & (1 << (bit)))
+
+//*************** Interrupts ***************
+
+// A pending interrupt with no ISR would send the AVR back to the reset vector. Treat it as a bug
+static sim_event_fn handler(sim_event_fn vector, const char *name)
+{
+  if(!vector) {
+    fprintf(stderr, "sim: %s is enabled but the firmware has no ISR for it\n", name);
+    exit(2);
+  }
+
+  return vector;
+}
+
+#define HANDLER(vector) handler(vector, #vector)
+
+// Vectors in priority order (lowest vector number first), with the flags that trigger them
+static sim_event_fn pending_vector(void)
+{
+  if(BIT(EIMSK, INT0) && BIT(EIFR, INTF0)) {
+    sim_regs[SIM_EIFR] &= ~(1 << INTF0);
+    return HANDLER(INT0_vect);
+  }
+  if(BIT(EIMSK, INT1) && BIT(EIFR, INTF1)) {
+    sim_regs[SIM_EIFR] &= ~(1 << INTF1);
+    return HANDLER(INT1_vect);
+  }
+  if(BIT(TIMSK2, TOIE2) && BIT(TIFR2, TOV2)) {
+    sim_regs[SIM_TIFR2] &= ~(1 << TOV2);
+    return HANDLER(TIMER2_OVF_vect);
+  }
+  if(BIT(TIMSK1, ICIE1) && BIT(TIFR1, ICF1)) {
+    sim_regs[SIM_TIFR1] &= ~(1 << ICF1);
+    return HANDLER(TIMER1_CAPT_vect);
+  }
+  if(BIT(UCSR0B, RXCIE0) && BIT(UCSR0A, RXC0))
+    return HANDLER(USART_RX_vect);             // Cleared by reading UDR0
+  if(BIT(UCSR0B, UDRIE0) && BIT(UCSR0A, UDRE0))
+    return HANDLER(USART_UDRE_vect);           // Cleared by writing UDR0
+  if(BIT(ADCSRA, ADIE) && BIT(ADCSRA, ADIF)) {
+    sim_regs[SIM_ADCSRA] &= ~(1 << ADIF);
+    return HANDLER(ADC_vect);
+  }
+  if(BIT(TWCR, TWIE) && BIT(TWCR, TWINT))
+    return HANDLER(TWI_vect);                  // Cleared by writing TWINT
+
+  return 0;
+}
+
+static uint8_t interrupt_pending(void)
+{
+  return (BIT(EIMSK, INT0) && BIT(EIFR, INTF0)) || (BIT(EIMSK, INT1) && BIT(EIFR, INTF1)) ||
+         (BIT(TIMSK2, TOIE2) && BIT(TIFR2, TOV2)) || (BIT(TIMSK1, ICIE1) && BIT(TIFR1, ICF1)) ||
+         (BIT(UCSR0B, RXCIE0) && BIT(UCSR0A, RXC0)) || (BIT(UCSR0B, UDRIE0) && BIT(UCSR0A, UDRE0)) ||
+         (BIT(ADCSRA, ADIE) && BIT(ADCSRA, ADIF)) || (BIT(TWCR, TWIE) && BIT(TWCR, TWINT));
+}
+
+#define SIM_ISR_CYCLES 20   // Vector jump, prologue and epilogue, reti
+
+// Run every interrupt that is pending and enabled, highest priority first, like the AVR does
+static void dispatch(void)
+{
+  sim_event_fn vector;
+
+  while(!in_isr && BIT(SREG, SREG_I) && (vector = pending_vector())) {
+    in_isr = 1;
+    sim_regs[SIM_SREG] &= ~(1 << SREG_I);
+    sim_cycles += SIM_ISR_CYCLES;
+    vector();
+    sim_regs[SIM_SREG] |= (1 << SREG_I);
+    in_isr = 0;
+    isr_count++;
+  }
+}
+
+//*************** Time ***************
+
+// Move time forward to `to`, running events (and any interrupts they raise) on the way
+static void advance(uint64_t to)
+{
+  while(!events.empty() && events.top().at <= to) {
+    sim_event e = events.top();
+    events.pop();
+
+    if(e.at > sim_cycles)
+      sim_cycles = e.at;
+    sim_event_at = e.at;
+    e.fn();
+    dispatch();
+  }
+
+  if(to > sim_cycles)
+    sim_cycles = to;
+
+  if(sim_cycles >= stop_at && !in_isr)
+    longjmp(stop_jump, 1);
+}
+
+static void tick(uint32_t cycles)
+{
+  advance(sim_cycles + cycles);
+  dispatch();
+}
+
+void sim_cli(void)
+{
+  tick(1);
+  sim_regs[SIM_SREG] &= ~(1 << SREG_I);
+}
+
+void sim_sei(void)
+{
+  sim_regs[SIM_SREG] |= (1 << SREG_I);
+  tick(1);
+}
+
+void sim_sleep(void)
+{
+  uint32_t serviced = isr_count;
+
+  // Idle until an interrupt has run (events dispatch as they go), or one is pending with I clear.
+  // With nothing left to happen the firmware would hang here forever
+  while(isr_count == serviced && !interrupt_pending()) {
+    if(events.empty()) {
+      fprintf(stderr, "sim: sleeping with nothing left to wake up\n");
+      exit(2);
+    }
+    advance(events.top().at);
+  }
+
+  dispatch();
+}
+
+void sim_delay_us(double us)
+{
+  uint64_t end = sim_cycles + (uint64_t)(us * (SIM_F_CPU / 1000000));
+
+  while(sim_cycles < end)
+    tick(end - sim_cycles);
+}
+
+uint8_t sim_run(uint64_t stop)
+{
+  stop_at = stop;
+
+  if(setjmp(stop_jump))
+    return 0;
+
+  sim_regs[SIM_UCSR0A] = (1 << UDRE0);
+  sim_regs[SIM_TWSR] = TW_NO_INFO;
+  mpu_reset();
+
+  hovercraft_main();
+  return 1;
+}
+
+//*************** External interrupts ***************
+
+static uint8_t pin_echo = 0, pin_imu_int = 0;
+
+// Set the flag if this change matches the sense selected in EICRA (level triggering isn't used)
+static void pin_change(uint8_t *pin, uint8_t level, uint8_t sense_shift, uint8_t flag)
+{
+  uint8_t sense = (sim_regs[SIM_EICRA] >> sense_shift) & 3;
+
+  if(level == *pin)
+    return;
+  *pin = level;
+
+  if(sense == 1 || (sense == 2 && !level) || (sense == 3 && level))
+    sim_regs[SIM_EIFR] |= (1 << flag);
+}
+
+void sim_set_echo(uint8_t level)
+{
+  pin_change(&pin_echo, level, ISC00, INTF0);
+}
+
+void sim_set_imu_int(uint8_t level)
+{
+  pin_change(&pin_imu_int, level, ISC10, INTF1);
+}
+
+//*************** Timer2: 8-bit, overflow interrupt ***************
+
+static uint64_t t2_base;            // When TCNT2 was last 0
+static uint64_t t2_due = 0;         // Next overflow, 0 when stopped
+
+static uint32_t t2_prescale(void)
+{
+  static const uint16_t prescale[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+  return prescale[sim_regs[SIM_TCCR2B] & 7];
+}
+
+static void t2_overflow(void)
+{
+  if(sim_event_at != t2_due)
+    return;
+
+  sim_regs[SIM_TIFR2] |= (1 << TOV2);
+  t2_base = t2_due;
+  t2_due += 256 * t2_prescale();
+  sim_schedule(t2_overflow, t2_due);
+}
+
+static void t2_restart(void)
+{
+  uint32_t prescale = t2_prescale();
+
+  t2_due = prescale ? t2_base + 256 * prescale : 0;
+  if(t2_due)
+    sim_schedule(t2_overflow, t2_due);
+}
+
+//*************** Timer1: phase and frequency correct PWM, TOP = ICR1 ***************
+
+static uint64_t t1_due = 0;
+
+static uint32_t t1_frame(void)
+{
+  static const uint16_t prescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+  return 2UL * sim_regs[SIM_ICR1] * prescale[sim_regs[SIM_TCCR1B] & 7];
+}
+
+static void t1_top(void)
+{
+  if(sim_event_at != t1_due)
+    return;
+
+  sim_regs[SIM_TIFR1] |= (1 << ICF1);  // Input capture flag doubles as "reached TOP" in this mode
+  t1_due += t1_frame();
+  sim_schedule(t1_top, t1_due);
+}
+
+static void t1_restart(void)
+{
+  uint32_t frame = t1_frame();
+
+  t1_due = frame ? sim_cycles + frame / 2 : 0;
+  if(t1_due)
+    sim_schedule(t1_top, t1_due);
+}
+
+//*************** ADC ***************
+
+static uint64_t adc_due = 0;
+static uint16_t adc_result = 0;
+static uint8_t adc_first = 1;       // The first conversion after enabling takes 25 ADC clocks, not 13
+
+static void adc_done(void);
+
+static void adc_start(void)
+{
+  uint32_t clocks = adc_first ? 25 : 13;
+
+  adc_first = 0;
+  adc_due = sim_cycles + clocks * (2U << ((sim_regs[SIM_ADCSRA] & 7) ? (sim_regs[SIM_ADCSRA] & 7) - 1 : 0));
+  sim_schedule(adc_done, adc_due);
+}
+
+static void adc_done(void)
+{
+  if(sim_event_at != adc_due)
+    return;
+
+  adc_result = craft_adc(sim_regs[SIM_ADMUX] & 0x0F) & 0x3FF;
+  if(BIT(ADMUX, ADLAR))
+    adc_result <<= 6;
+
+  sim_regs[SIM_ADCSRA] |= (1 << ADIF);
+  adc_due = 0;
+
+  if(BIT(ADCSRA, ADATE) && (sim_regs[SIM_ADCSRB] & 7) == 0)
+    adc_start();  // Free running: the next conversion starts straight away
+  else
+    sim_regs[SIM_ADCSRA] &= ~(1 << ADSC);
+}
+
+//*************** TWI master ***************
+
+#define TWI_IDLE 0
+#define TWI_ADDRESS 1               // START done, TWDR holds SLA+R/W
+#define TWI_TRANSMIT 2
+#define TWI_RECEIVE 3
+
+static uint8_t twi_state = TWI_IDLE;
+static uint8_t twi_status, twi_rx;
+static uint64_t twi_due = 0, twi_stop_due = 0;
+
+// One bit on the bus: SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS)
+static uint32_t twi_bit(void)
+{
+  return 16 + 2 * sim_regs[SIM_TWBR] * (1 << (2 * (sim_regs[SIM_TWSR] & 3)));
+}
+
+static void twi_done(void)
+{
+  if(sim_event_at != twi_due)
+    return;
+
+  twi_due = 0;
+  sim_regs[SIM_TWSR] = (sim_regs[SIM_TWSR] & 3) | twi_status;
+  if(twi_state == TWI_RECEIVE)
+    sim_regs[SIM_TWDR] = twi_rx;
+  sim_regs[SIM_TWCR] |= (1 << TWINT);
+}
+
+static void twi_finish(uint8_t status, uint32_t bits)
+{
+  twi_status = status;
+  twi_due = sim_cycles + bits * twi_bit();
+  sim_schedule(twi_done, twi_due);
+}
+
+static void twi_start(void)
+{
+  twi_finish(twi_state == TWI_IDLE ? TW_START : TW_REP_START, 2);
+  twi_state = TWI_ADDRESS;
+}
+
+static void twi_stop_done(void)
+{
+  if(sim_event_at != twi_stop_due)
+    return;
+
+  twi_stop_due = 0;
+  sim_regs[SIM_TWCR] &= ~(1 << TWSTO);
+
+  if(BIT(TWCR, TWSTA))
+    twi_start();  // STOP followed by START
+}
+
+static void twi_control(uint8_t value)
+{
+  uint8_t twint = BIT(TWCR, TWINT) && !(value & (1 << TWINT));  // Writing a one clears TWINT
+
+  sim_regs[SIM_TWCR] = (value & ~(1 << TWINT)) | (twint ? (1 << TWINT) : 0);
+
+  if(!(value & (1 << TWEN))) {
+    twi_state = TWI_IDLE;
+    twi_due = twi_stop_due = 0;
+    return;
+  }
+
+  if(!(value & (1 << TWINT)))
+    return;
+
+  if(value & (1 << TWSTO)) {
+    if(twi_state != TWI_IDLE)
+      mpu_twi_stop();
+    twi_state = TWI_IDLE;
+    twi_stop_due = sim_cycles + twi_bit();
+    sim_schedule(twi_stop_done, twi_stop_due);
+    return;
+  }
+
+  if(value & (1 << TWSTA)) {
+    twi_start();
+    return;
+  }
+
+  switch(twi_state) {
+    case TWI_ADDRESS: {
+      uint8_t sla = sim_regs[SIM_TWDR];
+      uint8_t read = sla & 1;
+      uint8_t ack = mpu_twi_start(sla >> 1, read);
+
+      if(read)
+        twi_finish(ack ? TW_MR_SLA_ACK : TW_MR_SLA_NACK, 9);
+      else
+        twi_finish(ack ? TW_MT_SLA_ACK : TW_MT_SLA_NACK, 9);
+      twi_state = read ? TWI_RECEIVE : TWI_TRANSMIT;
+      break;
+    }
+
+    case TWI_TRANSMIT:
+      mpu_twi_write(sim_regs[SIM_TWDR]);
+      twi_finish(TW_MT_DATA_ACK, 9);
+      break;
+
+    case TWI_RECEIVE:
+      twi_rx = mpu_twi_read();
+      twi_finish((value & (1 << TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK, 9);
+      break;
+
+    default:
+      twi_finish(TW_BUS_ERROR, 1);
+  }
+}
+
+//*************** USART ***************
+
+static void (*uart_sink)(uint8_t c) = 0;
+static uint8_t tx_shift = 0, tx_buffer = 0, tx_buffered = 0;
+static uint64_t tx_due = 0, rx_due = 0;
+static std::deque<uint8_t> rx_queue;
+static uint8_t rx_data = 0;
+
+void sim_uart_output(void (*sink)(uint8_t c))
+{
+  uart_sink = sink;
+}
+
+// Start bit, 8 data bits and a stop bit
+static uint32_t uart_frame(void)
+{
+  uint32_t ubrr = ((uint32_t)sim_regs[SIM_UBRR0H] << 8) | sim_regs[SIM_UBRR0L];
+  return 10 * (BIT(UCSR0A, U2X0) ? 8 : 16) * (ubrr + 1);
+}
+
+static void uart_tx_done(void)
+{
+  if(sim_event_at != tx_due)
+    return;
+
+  if(uart_sink)
+    uart_sink(tx_shift);
+
+  if(tx_buffered) {
+    // The buffered character moves into the shift register and UDR0 is free again
+    tx_shift = tx_buffer;
+    tx_buffered = 0;
+    sim_regs[SIM_UCSR0A] |= (1 << UDRE0);
+    tx_due = sim_cycles + uart_frame();
+    sim_schedule(uart_tx_done, tx_due);
+  } else {
+    tx_due = 0;
+    sim_regs[SIM_UCSR0A] |= (1 << TXC0);
+  }
+}
+
+static void uart_tx(uint8_t c)
+{
+  if(!BIT(UCSR0B, TXEN0))
+    return;
+
+  if(!tx_due) {
+    tx_shift = c;
+    tx_due = sim_cycles + uart_frame();
+    sim_schedule(uart_tx_done, tx_due);
+  } else {
+    tx_buffer = c;  // Overwrites if the firmware didn't wait for UDRE0, as on the chip
+    tx_buffered = 1;
+    sim_regs[SIM_UCSR0A] &= ~(1 << UDRE0);
+  }
+}
+
+static void uart_rx_next(void);
+
+static void uart_rx_done(void)
+{
+  if(sim_event_at != rx_due)
+    return;
+
+  rx_due = 0;
+
+  if(BIT(UCSR0A, RXC0))
+    sim_regs[SIM_UCSR0A] |= (1 << DOR0);  // The last one wasn't read in time and this one is lost
+  else
+    rx_data = rx_queue.front(), sim_regs[SIM_UCSR0A] |= (1 << RXC0);
+
+  rx_queue.pop_front();
+  uart_rx_next();
+}
+
+static void uart_rx_next(void)
+{
+  if(rx_due || rx_queue.empty() || !BIT(UCSR0B, RXEN0))
+    return;
+
+  rx_due = sim_cycles + uart_frame();
+  sim_schedule(uart_rx_done, rx_due);
+}
+
+void sim_uart_rx(uint8_t c)
+{
+  rx_queue.push_back(c);
+  uart_rx_next();
+}
+
+//*************** Register access ***************
+
+uint16_t sim_read(uint8_t id)
+{
+  tick(SIM_ACCESS_CYCLES);
+
+  switch(id) {
+    case SIM_PIND:
+      return (sim_regs[SIM_PORTD] & ~((1 << PD2) | (1 << PD3))) | (pin_echo << PD2) | (pin_imu_int << PD3);
+
+    case SIM_TCNT2: {
+      uint32_t prescale = t2_prescale();
+      return prescale ? ((sim_cycles - t2_base) / prescale) & 0xFF : sim_regs[SIM_TCNT2];
+    }
+
+    case SIM_ADC:
+      return adc_result;
+    case SIM_ADCL:
+      return adc_result & 0xFF;
+    case SIM_ADCH:
+      return adc_result >> 8;
+
+    case SIM_UDR0: {
+      uint8_t c = rx_data;
+      sim_regs[SIM_UCSR0A] &= ~((1 << RXC0) | (1 << DOR0));
+      return c;
+    }
+  }
+
+  return sim_regs[id];
+}
+
+void sim_write(uint8_t id, uint16_t value)
+{
+  uint16_t old = sim_regs[id];
+
+  tick(SIM_ACCESS_CYCLES);
+
+  switch(id) {
+    case SIM_EIFR:
+    case SIM_TIFR1:
+    case SIM_TIFR2:
+      sim_regs[id] &= ~value;  // Flags are cleared by writing a one
+      return;
+
+    case SIM_PORTB:
+      sim_regs[id] = value;
+      if((old & (1 << PB3)) && !(value & (1 << PB3)))
+        craft_trigger();  // End of the ultrasonic trigger pulse
+      return;
+
+    case SIM_TCNT2:
+      sim_regs[id] = value;
+      t2_base = sim_cycles - (uint64_t)value * t2_prescale();
+      t2_restart();
+      return;
+
+    case SIM_TCCR2B:
+      if((old & 7) == (value & 7))
+        break;
+      t2_base = sim_cycles;
+      sim_regs[id] = value;
+      t2_restart();
+      return;
+
+    case SIM_TCCR1B:
+      sim_regs[id] = value;
+      if((old & 7) != (value & 7))
+        t1_restart();
+      return;
+
+    case SIM_ADCSRA:
+      sim_regs[id] = (value & ~(1 << ADIF)) | (old & (1 << ADIF) & ~value);
+      if(!(value & (1 << ADEN))) {
+        adc_due = 0;
+        adc_first = 1;
+        sim_regs[id] &= ~(1 << ADSC);
+      } else if((value & (1 << ADSC)) && !adc_due) {
+        adc_start();
+      }
+      return;
+
+    case SIM_TWCR:
+      twi_control(value);
+      return;
+
+    case SIM_UDR0:
+      uart_tx(value);
+      return;
+
+    case SIM_UCSR0A:
+      sim_regs[id] = (old & ~((1 << U2X0) | (1 << MPCM0))) | (value & ((1 << U2X0) | (1 << MPCM0)));
+      if(value & (1 << TXC0))
+        sim_regs[id] &= ~(1 << TXC0);
+      return;
+
+    case SIM_UCSR0B:
+      sim_regs[id] = value;
+      uart_rx_next();
+      return;
+  }
+
+  sim_regs[id] = value;
+
+  if(id == SIM_SREG)
+    dispatch();
+}
@@ -0,0 +1,22 @@
+#ifndef sim_util_crc16_h
+#define sim_util_crc16_h
+
+#include <stdint.h>
+
+// Same results as the avr-libc versions
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+  data ^= crc & 0xFF;
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data)
+{
+  crc ^= data;
+  for(uint8_t i = 0; i < 8; i++)
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  return crc;
+}
+
+#endif
@@ -0,0 +1 @@
+#include "../avr/delay.h"
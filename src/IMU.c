@@ -1,15 +1,49 @@
 #include "IMU.h"
 #include "TWI_290.h"
+#include "timebase.h"
+#include "convert.h"
+#include "profiler.h"
 #include <avr/delay.h>
 #include <avr/interrupt.h>
-#include <math.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <avr/pgmspace.h>
 
-const int CALIBRATION_SAMPLES = 300;
+#define CALIBRATION_SHIFT 8
+#define CALIBRATION_SAMPLES (1 << CALIBRATION_SHIFT) // A power of 2, so averaging is a shift
 
-volatile float gyro_lsb_sensitivity;   // Determined by gyro configuration
+/*
+  The ATmega328P has no FPU, so the hot path works on raw int16_t counts. A rate in counts is turned
+  into an angle increment in Q16.16 degrees with one multiply and a shift:
+    increment = counts * dt_us * 65536 / (lsb_sensitivity * 10^6) = (counts * dt_us * gyro_scale_m) >> gyro_scale_shift
+  gyro_scale_m/gyro_scale_shift are picked per range in set_gyro_config() (constants from convert.h).
+*/
+uint16_t gyro_scale_m;              // Determined by gyro configuration
+uint8_t gyro_scale_shift;
+float gyro_dps_per_lsb;             // Only used by the float conversion functions
 
-volatile float gyro_x, gyro_y, gyro_z;
-float gyro_offset_x = 0, gyro_offset_y = 0, gyro_offset_z = 0;
+volatile int16_t gyro_x, gyro_y, gyro_z;  // Latest rates in counts, bias removed
+int16_t accel_x, accel_y, accel_z;        // Latest raw accel counts
+int16_t gyro_offset_x = 0, gyro_offset_y = 0, gyro_offset_z = 0;  // Bias in counts
+int16_t accel_offset_x = 0, accel_offset_y = 0, accel_offset_z = 0; // Reading when level, minus 1g on z
+
+volatile uint8_t imu_data_ready = 0;
+uint16_t imu_fifo_overflows = 0;
+uint16_t fifo_sample_period_us;     // Time between FIFO samples
+uint32_t imu_sample_time = 0;       // micros() when the latest sample was taken
+static int16_t calibration_temp = 0;      // Temperature the offsets were measured at, in MPU counts
+static uint16_t calibration_failures = 0; // Frames that failed to read in the last calibrate_imu()
+static uint8_t have_sample_time = 0;
+
+static uint8_t read_gyro_counts(int16_t *data_buffer);
+
+// The MPU pulses its INT pin every time a new sample has been written to the FIFO
+ISR(INT1_vect)
+{
+  PROFILE_BEGIN(int1);
+  imu_data_ready++;
+  PROFILE_END(int1);
+}
 
 void imu_init(uint16_t gyro_sensitivity) {
   // Initialise TWI
@@ -18,30 +52,211 @@ void imu_init(uint16_t gyro_sensitivity) {
 
   set_gyro_config(gyro_sensitivity);
 
-  Write_Reg(MPU_ADDRESS, 0x6B, 0);  // PWR_MGMT_1 register set to 0 to wake up MPU
+  Write_Reg(MPU_ADDRESS, PWR_MGMT_1, 0);  // PWR_MGMT_1 register set to 0 to wake up MPU
 }
 
 // I got the idea to calibrate from here: https://howtomechatronics.com/tutorials/arduino/arduino-and-mpu6050-accelerometer-and-gyroscope-tutorial/
 // and from here: https://github.com/rfetick/MPU6050_light
-void calibrate_imu() 
+uint16_t calibrate_imu() 
 {
-  // For gyro calibration
-  float gyro_x = 0, gyro_y = 0, gyro_z = 0;
-  float gx, gy, gz;
+  // Gyro and accel sums, in imu_frame_t order
+  int32_t sum[IMU_FRAME_BYTES / 2] = {0};
+  imu_frame_t frame;
+  uint16_t good = 0;
+
+  // A frame that fails to read is skipped rather than averaged in, so the sums are always over
+  // CALIBRATION_SAMPLES good frames. As many failures as that and the bus is taken to be dead
+  calibration_failures = 0;
+  while(good < CALIBRATION_SAMPLES && calibration_failures < CALIBRATION_SAMPLES) {
+    if(read_imu_frame(&frame)) {
+      calibration_failures++;
+    }
+    else {
+      int16_t *reading = (int16_t*)&frame;
+      for(uint8_t j = 0; j < IMU_FRAME_BYTES / 2; j++)
+        sum[j] += reading[j];
+      good++;
+    }
+
+    _delay_ms(2); // A 14 byte burst takes ~1.7ms at 100kHz, so this is ~1s in total
+  }
+
+  if(good < CALIBRATION_SAMPLES)
+    return calibration_failures;  // Leave the offsets as they were
+
+  // Update offsets. The board is assumed to be sitting level, so z should read 1g
+  accel_offset_x = sum[0] >> CALIBRATION_SHIFT;
+  accel_offset_y = sum[1] >> CALIBRATION_SHIFT;
+  accel_offset_z = (sum[2] >> CALIBRATION_SHIFT) - ACCEL_1G;
+  calibration_temp = sum[3] >> CALIBRATION_SHIFT;
+  gyro_offset_x = sum[4] >> CALIBRATION_SHIFT;
+  gyro_offset_y = sum[5] >> CALIBRATION_SHIFT;
+  gyro_offset_z = sum[6] >> CALIBRATION_SHIFT;
+
+  return calibration_failures;
+}
+
+/*
+  Calibration is kept in EEPROM so a normal boot doesn't have to sit still for a second. The record is
+  thrown away if its CRC doesn't match, if it was taken at a different gyro range, or if the MPU is more
+  than IMU_CAL_TEMP_TOLERANCE away from the temperature it was calibrated at (the gyro bias drifts with
+  temperature). eeprom_update_block() only writes bytes that changed, so saving often doesn't wear it out.
+  Nothing is saved after a calibration that had to skip frames, so a bad one is redone on the next boot.
+*/
+static imu_calibration_t EEMEM calibration_eeprom;
+
+static uint16_t calibration_crc(const imu_calibration_t *cal)
+{
+  const uint8_t *p = (const uint8_t*)cal;
+  uint16_t crc = 0xFFFF;
+
+  for(uint8_t i = 0; i < sizeof(imu_calibration_t) - sizeof(cal->crc); i++)
+    crc = _crc_ccitt_update(crc, p[i]);
+
+  return crc;
+}
+
+uint8_t imu_calibration_load(uint16_t range)
+{
+  imu_calibration_t cal;
+  imu_frame_t frame;
+
+  eeprom_read_block(&cal, &calibration_eeprom, sizeof(cal));
+
+  if(cal.version != IMU_CAL_VERSION || cal.crc != calibration_crc(&cal))
+    return IMU_CAL_MISSING;
+
+  if(cal.gyro_range != range || read_imu_frame(&frame) != 0)
+    return IMU_CAL_STALE;
+
+  int16_t temp_change = frame.temp - cal.temp;
+  if(temp_change > IMU_CAL_TEMP_TOLERANCE || temp_change < -IMU_CAL_TEMP_TOLERANCE)
+    return IMU_CAL_STALE;
+
+  gyro_offset_x = cal.gyro_offset[0];
+  gyro_offset_y = cal.gyro_offset[1];
+  gyro_offset_z = cal.gyro_offset[2];
+  accel_offset_x = cal.accel_offset[0];
+  accel_offset_y = cal.accel_offset[1];
+  accel_offset_z = cal.accel_offset[2];
+  calibration_temp = cal.temp;
+
+  return IMU_CAL_OK;
+}
+
+uint8_t imu_calibration_save(uint16_t range)
+{
+  imu_calibration_t cal;
+
+  if(calibration_failures)
+    return 1; // A flaky bus during calibration: don't make it look trustworthy with a valid CRC
+
+  cal.version = IMU_CAL_VERSION;
+  cal.gyro_range = range;
+  cal.temp = calibration_temp;
+  cal.gyro_offset[0] = gyro_offset_x;
+  cal.gyro_offset[1] = gyro_offset_y;
+  cal.gyro_offset[2] = gyro_offset_z;
+  cal.accel_offset[0] = accel_offset_x;
+  cal.accel_offset[1] = accel_offset_y;
+  cal.accel_offset[2] = accel_offset_z;
+  cal.crc = calibration_crc(&cal);
+
+  eeprom_update_block(&cal, &calibration_eeprom, sizeof(cal));
+  return 0;
+}
+
+// The MPU sends the high byte of each register pair first, but the AVR stores int16_t low byte first
+static void swap_bytes(int16_t *words, uint8_t count)
+{
+  uint8_t *p = (uint8_t*)words;
+
+  for(uint8_t i = 0; i < count; i++, p += 2) {
+    uint8_t high = p[0];
+    p[0] = p[1];
+    p[1] = high;
+  }
+}
+
+/*
+  Online refinement. Whenever the gyro reads close to zero and the accelerometer is steady for
+  IMU_STILL_SAMPLES samples in a row, the craft is sitting still, so whatever the gyro reads is bias.
+  The calibration offsets are moved half way towards that average. This also tracks the z bias,
+  which the fusion filter can't see. Fan vibration keeps the detector from firing while under way.
+  The fusion filter's x/y bias sits on top of the offsets, so it's moved back by as much as they move:
+  the total correction stays the same and the two estimators don't pull against each other.
+
+  The FIFO has no temperature in it, so after a drain that refined the offsets the temperature is read
+  once, outside the per-sample loop (refine_temperature()). The offsets are saved with the temperature
+  they were last refined at, not the one they were first calibrated at.
+*/
+uint8_t imu_still = 0;
+uint16_t imu_still_refinements = 0;
+static uint8_t still_temp_due = 0;      // Refined since calibration_temp was last read
+static uint8_t still_count = 0;
+static int32_t still_sum_x, still_sum_y, still_sum_z;
+static int16_t last_accel_x, last_accel_y, last_accel_z;
+
+static inline uint8_t within(int16_t value, int16_t limit)
+{
+  return value <= limit && value >= -limit;
+}
+
+// One register read, so it's kept out of the sample loop. Tried again after the next drain if it fails
+static void refine_temperature(void)
+{
+  int16_t temp;
+
+  if(Read_Reg_N(MPU_ADDRESS, TEMP_OUT_H, 2, &temp))
+    return;
+  swap_bytes(&temp, 1);
+
+  calibration_temp = temp;
+  still_temp_due = 0;
+}
+
+static void still_update(const imu_fifo_sample_t *sample)
+{
+  int16_t x = sample->gyro_x - gyro_offset_x;
+  int16_t y = sample->gyro_y - gyro_offset_y;
+  int16_t z = sample->gyro_z - gyro_offset_z;
+  uint8_t steady = within(sample->accel_x - last_accel_x, IMU_STILL_ACCEL_COUNTS) &&
+                   within(sample->accel_y - last_accel_y, IMU_STILL_ACCEL_COUNTS) &&
+                   within(sample->accel_z - last_accel_z, IMU_STILL_ACCEL_COUNTS);
 
-  for (int i = 0; i < CALIBRATION_SAMPLES; i++) {
-    // Increment gyro sums
-    gyro_x += gx;
-    gyro_y += gy;
-    gyro_z += gz;
+  last_accel_x = sample->accel_x;
+  last_accel_y = sample->accel_y;
+  last_accel_z = sample->accel_z;
 
-    _delay_ms(5);
+  if(!steady || !within(x, IMU_STILL_GYRO_COUNTS) || !within(y, IMU_STILL_GYRO_COUNTS) || !within(z, IMU_STILL_GYRO_COUNTS)) {
+    imu_still = 0;
+    still_count = 0;
+    still_sum_x = still_sum_y = still_sum_z = 0;
+    return;
   }
 
-  // Update offset
-  gyro_offset_x = gyro_x / CALIBRATION_SAMPLES;
-  gyro_offset_y = gyro_y / CALIBRATION_SAMPLES;
-  gyro_offset_z = gyro_z / CALIBRATION_SAMPLES;
+  still_sum_x += x;
+  still_sum_y += y;
+  still_sum_z += z;
+
+  if(++still_count < IMU_STILL_SAMPLES)
+    return;
+
+  // Half of the average, rounded
+  int16_t step_x = (still_sum_x + IMU_STILL_SAMPLES / 2) >> (IMU_STILL_SHIFT + 1);
+  int16_t step_y = (still_sum_y + IMU_STILL_SAMPLES / 2) >> (IMU_STILL_SHIFT + 1);
+
+  gyro_offset_x += step_x;
+  gyro_offset_y += step_y;
+  gyro_offset_z += (still_sum_z + IMU_STILL_SAMPLES / 2) >> (IMU_STILL_SHIFT + 1);
+  gyro_bias_x -= (int32_t)step_x << 8;
+  gyro_bias_y -= (int32_t)step_y << 8;
+  still_temp_due = 1;
+
+  imu_still = 1;
+  imu_still_refinements++;
+  still_count = 0;
+  still_sum_x = still_sum_y = still_sum_z = 0;
 }
 
 uint8_t set_gyro_config(uint16_t range) 
@@ -51,19 +266,27 @@ uint8_t set_gyro_config(uint16_t range)
   switch (range) {
     case 250:
       status = Write_Reg(MPU_ADDRESS, GYRO_CONFIG, 0x00);  // Set range to ±250
-      gyro_lsb_sensitivity = 131.0;
+      gyro_dps_per_lsb = 1 / 131.0;
+      gyro_scale_m = GYRO_SCALE_M_250;
+      gyro_scale_shift = GYRO_SCALE_SHIFT_250;
       break;
     case 500:
       status = Write_Reg(MPU_ADDRESS, GYRO_CONFIG, 0x08);  // Set range to ±500
-      gyro_lsb_sensitivity = 65.5;
+      gyro_dps_per_lsb = 1 / 65.5;
+      gyro_scale_m = GYRO_SCALE_M_500;
+      gyro_scale_shift = GYRO_SCALE_SHIFT_500;
       break;
     case 1000:
       status = Write_Reg(MPU_ADDRESS, GYRO_CONFIG, 0x10);  // Set range to ±1000
-      gyro_lsb_sensitivity = 32.8;
+      gyro_dps_per_lsb = 1 / 32.8;
+      gyro_scale_m = GYRO_SCALE_M_1000;
+      gyro_scale_shift = GYRO_SCALE_SHIFT_1000;
       break;
     case 2000:
       status = Write_Reg(MPU_ADDRESS, GYRO_CONFIG, 0x18);  // Set range to ±2000
-      gyro_lsb_sensitivity = 16.4;
+      gyro_dps_per_lsb = 1 / 16.4;
+      gyro_scale_m = GYRO_SCALE_M_2000;
+      gyro_scale_shift = GYRO_SCALE_SHIFT_2000;
       break;
     default:
       status = 1;  // Invalid argument
@@ -72,33 +295,430 @@ uint8_t set_gyro_config(uint16_t range)
   return status;
 }
 
-void read_gyro(float *gx, float *gy, float *gz) 
+// Raw gyro x, y and z in one burst. The MPU auto-increments the register address
+static uint8_t read_gyro_counts(int16_t *data_buffer)
 {
-  int16_t data_buffer[2];
+  uint8_t status = Read_Reg_N(MPU_ADDRESS, GYRO_XOUT_H, 6, data_buffer);
+  swap_bytes(data_buffer, 3);
 
-  // Read the gyro x data
-  Read_Reg_N(MPU_ADDRESS, 0x43, 2, data_buffer);  // 0x43 = GYRO_XOUT_H
-  int16_t raw_data_x = (data_buffer[0] << 8) | (data_buffer[1] & 0xFF);
+  return status;
+}
+
+void read_gyro_raw(int16_t *gx, int16_t *gy, int16_t *gz)
+{
+  int16_t data_buffer[3];
 
-  // Read the gyro y data
-  Read_Reg_N(MPU_ADDRESS, 0x45, 2, data_buffer);  // 0x45 = GYRO_YOUT_H
-  int16_t raw_data_y = (data_buffer[0] << 8) | (data_buffer[1] & 0xFF);
+  read_gyro_counts(data_buffer);
 
-  // Read the gyro z data
-  Read_Reg_N(MPU_ADDRESS, 0x47, 2, data_buffer);  // 0x47 = GYRO_ZOUT_H
-  int16_t raw_data_z = (data_buffer[0] << 8) | (data_buffer[1] & 0xFF);
+  *gx = data_buffer[0] - gyro_offset_x;
+  *gy = data_buffer[1] - gyro_offset_y;
+  *gz = data_buffer[2] - gyro_offset_z;
+}
+
+void read_gyro(float *gx, float *gy, float *gz) 
+{
+  int16_t x, y, z;
+
+  read_gyro_raw(&x, &y, &z);
 
   // Convert to degreees/sec using conversion factor
-  *gx = raw_data_x / gyro_lsb_sensitivity - gyro_offset_x;
-  *gy = raw_data_y / gyro_lsb_sensitivity - gyro_offset_y;
-  *gz = raw_data_z / gyro_lsb_sensitivity - gyro_offset_z;
+  *gx = x * gyro_dps_per_lsb;
+  *gy = y * gyro_dps_per_lsb;
+  *gz = z * gyro_dps_per_lsb;
+}
+
+// (p * m) >> shift for shift > 16, without a 64-bit multiply. p is split into its high and low
+// 16 bits so that neither partial product can overflow 32 bits
+static inline int32_t mul_shift(int32_t p, uint16_t m, uint8_t shift)
+{
+  int32_t high = (p >> 16) * (int32_t)m;
+  uint32_t low = (uint32_t)(p & 0xFFFF) * m;
+
+  return (high + (int32_t)(low >> 16) + (1L << (shift - 17))) >> (shift - 16);  // Rounded, so there's no drift from truncation
+}
+
+angle_q16_t gyro_rate_to_angle(int16_t counts, uint16_t dt_us)
+{
+  return mul_shift((int32_t)counts * dt_us, gyro_scale_m, gyro_scale_shift);
+}
+
+angle_q16_t yaw_rate_to_angle(uint16_t dt_us)
+{
+  return gyro_rate_to_angle(gyro_z, dt_us);
+}
+
+float angle_q16_to_float(angle_q16_t angle)
+{
+  return angle * (1 / 65536.0);
+}
+
+uint8_t read_imu_frame(imu_frame_t *frame)
+{
+  uint8_t status = Read_Reg_N(MPU_ADDRESS, ACCEL_XOUT_H, IMU_FRAME_BYTES, (int16_t*)frame);
+  swap_bytes((int16_t*)frame, IMU_FRAME_BYTES / 2);
+
+  return status;
+}
+
+static twi_transaction_t frame_transaction;
+static volatile uint8_t frame_ready = 0;
+
+// Runs in the TWI ISR once the burst has finished
+static void frame_complete(twi_transaction_t *t)
+{
+  if(t->status)
+    return; // Failed: the frame is whatever arrived before the error, so it never becomes ready
+
+  swap_bytes((int16_t*)t->buffer, IMU_FRAME_BYTES / 2);
+  frame_ready = 1;
+}
+
+uint8_t start_imu_frame(imu_frame_t *frame)
+{
+  if(frame_transaction.status == TWI_PENDING)
+    return 1; // Previous frame still on the bus
+
+  frame_ready = 0;
+
+  frame_transaction.address = MPU_ADDRESS;
+  frame_transaction.reg = ACCEL_XOUT_H;
+  frame_transaction.read_write = TW_READ;
+  frame_transaction.length = IMU_FRAME_BYTES;
+  frame_transaction.buffer = (uint8_t*)frame;
+  frame_transaction.callback = frame_complete;
+
+  return TWI_submit(&frame_transaction);
+}
+
+uint8_t imu_frame_ready(void)
+{
+  return frame_ready;
+}
+
+uint8_t imu_frame_status(void)
+{
+  return frame_transaction.status;
 }
 
-void update_gyro_angles(float dt, float *gyro_angle_x, float *gyro_angle_y, float *gyro_angle_z) 
+// Timestamp a new polled sample and return the time since the previous one
+static uint16_t sample_interval_us(void)
 {
-  read_gyro(&gyro_x, &gyro_y, &gyro_z);
+  uint32_t now = micros();
+  uint32_t dt = now - imu_sample_time;
 
-  *gyro_angle_x += gyro_x * dt;
-  *gyro_angle_y += gyro_y * dt;
-  *gyro_angle_z += (gyro_z + 1) * dt;
-}
\ No newline at end of file
+  imu_sample_time = now;
+
+  if(!have_sample_time) {
+    have_sample_time = 1;
+    return 0; // Nothing to integrate over yet
+  }
+
+  return (dt > 0xFFFF) ? 0xFFFF : dt;
+}
+
+void update_gyro_angles(float *gyro_angle_x, float *gyro_angle_y, float *gyro_angle_z) 
+{
+  float gx, gy, gz;
+
+  read_gyro(&gx, &gy, &gz);
+
+  float dt = sample_interval_us() * 1e-6;
+
+  *gyro_angle_x += gx * dt;
+  *gyro_angle_y += gy * dt;
+  *gyro_angle_z += gz * dt;
+}
+
+void update_gyro_angles_fx(angle_q16_t *gyro_angle_x, angle_q16_t *gyro_angle_y, angle_q16_t *gyro_angle_z)
+{
+  int16_t x, y, z;
+
+  read_gyro_raw(&x, &y, &z);
+  uint16_t dt_us = sample_interval_us();
+  gyro_x = x;
+  gyro_y = y;
+  gyro_z = z;
+
+  *gyro_angle_x += gyro_rate_to_angle(x, dt_us);
+  *gyro_angle_y += gyro_rate_to_angle(y, dt_us);
+  *gyro_angle_z += gyro_rate_to_angle(z, dt_us);
+}
+
+/*
+  FIFO streaming: the MPU samples at a fixed rate and queues accel + gyro readings in its 1024 byte FIFO,
+  so nothing is lost while the main loop is busy. 1024 / 12 = 85 samples, which is 850ms at 100Hz.
+  Each sample is integrated with the MPU's own sample period rather than the loop period.
+*/
+uint8_t imu_fifo_init(uint8_t sample_rate_div)
+{
+  uint8_t status = 0;
+
+  status |= Write_Reg(MPU_ADDRESS, MPU_CONFIG, 0x03);         // DLPF at 44Hz, so the gyro output rate is 1kHz
+  status |= Write_Reg(MPU_ADDRESS, SMPLRT_DIV, sample_rate_div);
+  status |= Write_Reg(MPU_ADDRESS, INT_PIN_CFG, 0x00);        // Active high, push-pull, 50us pulse
+  status |= Write_Reg(MPU_ADDRESS, INT_ENABLE, 0x11);         // FIFO_OFLOW_EN | DATA_RDY_EN
+  status |= Write_Reg(MPU_ADDRESS, USER_CTRL, 0x04);          // FIFO_RESET
+  status |= Write_Reg(MPU_ADDRESS, FIFO_EN, 0x78);            // XG, YG, ZG and ACCEL into the FIFO
+  status |= Write_Reg(MPU_ADDRESS, USER_CTRL, 0x40);          // FIFO_EN
+
+  fifo_sample_period_us = (1 + sample_rate_div) * 1000;
+
+  // Data-ready interrupt on INT1, rising edge
+  DDRD &= ~(1 << IMU_INT_PIN);
+  EICRA |= (1 << ISC11) | (1 << ISC10);
+  EIMSK |= (1 << INT1);
+
+  return status;
+}
+
+uint8_t imu_fifo_read(imu_fifo_sample_t *samples, uint8_t max_samples)
+{
+  int16_t count;
+  int16_t int_status = 0;
+
+  if(Read_Reg_N(MPU_ADDRESS, INT_STATUS, 1, &int_status))  // Also clears the interrupt status. Byte lands in the low half
+    return 0;
+
+  if(int_status & 0x10) {
+    // FIFO_OFLOW_INT: the oldest samples have been overwritten, so the byte stream is no longer
+    // aligned to sample boundaries. Start again from an empty FIFO, and forget the samples that were
+    // counted into it (cleared first, so a sample arriving in between is counted rather than lost)
+    imu_data_taken(0xFF);
+    Write_Reg(MPU_ADDRESS, USER_CTRL, 0x44);  // FIFO_EN | FIFO_RESET
+    imu_fifo_overflows++;
+    return 0;
+  }
+
+  if(Read_Reg_N(MPU_ADDRESS, FIFO_COUNTH, 2, &count))
+    return 0;
+  swap_bytes(&count, 1);
+
+  if(max_samples > IMU_FIFO_BATCH)
+    max_samples = IMU_FIFO_BATCH;
+
+  // Number of whole samples available (avoids dividing by 12)
+  uint8_t n = 0;
+  while(count >= IMU_FIFO_SAMPLE_BYTES && n < max_samples) {
+    count -= IMU_FIFO_SAMPLE_BYTES;
+    n++;
+  }
+
+  if(n == 0)
+    return 0;
+
+  // FIFO_R_W doesn't auto-increment, so one burst pops n samples in order
+  if(Read_Reg_N(MPU_ADDRESS, FIFO_R_W, n * IMU_FIFO_SAMPLE_BYTES, (int16_t*)samples))
+    return 0;
+  swap_bytes((int16_t*)samples, n * (IMU_FIFO_SAMPLE_BYTES / 2));
+
+  imu_data_taken(n);
+
+  return n;
+}
+
+void imu_data_taken(uint8_t n)
+{
+  uint8_t sreg = SREG;
+  cli();
+  imu_data_ready = (imu_data_ready > n) ? imu_data_ready - n : 0;
+  SREG = sreg;
+}
+
+/*
+  Sensor fusion. A complementary filter per axis: the gyro is integrated as before, and roll and pitch
+  are pulled towards the accelerometer's estimate by 1/2^FUSION_ACCEL_SHIFT of the difference each
+  sample. The same difference is integrated into a gyro bias estimate (the I term of a Mahony filter),
+  so a constant gyro offset is trimmed out rather than just corrected for.
+
+  The accelerometer angles come from two fixed-length CORDICs, so every update costs the same: 2 x 14
+  shift-add iterations plus a handful of 16x16 multiplies, no divides, no floats, no data-dependent loops.
+  Samples where |a| is more than 1/8 away from 1g are taken to be accelerating and only the gyro is used.
+
+  Yaw is a rotation about gravity, so the accelerometer can't see it: the yaw bias is not observable here
+  and is left where it is (at zero, on top of the calibration offset). Roll and pitch are treated as body rates, which
+  is fine for a hovercraft that stays within a few degrees of level.
+*/
+#define CORDIC_ITERATIONS 14
+#define CORDIC_GAIN_Q14 26981                   // 1.64676 in Q2.14, the gain of CORDIC_ITERATIONS iterations
+#define FUSION_INPUT_SHIFT 8                    // Accel counts are scaled up before the CORDIC for resolution
+#define FUSION_ACCEL_1G_GAIN2 11374195L         // ACCEL_1G * gain^2 << FUSION_INPUT_SHIFT, the magnitude of 1g after both CORDICs
+
+// atan(2^-i) in Q16.16 degrees, worked out by the compiler. Exact even where double is only a float
+#define CORDIC_ATAN(i) ((int32_t)(__builtin_atan(1.0 / (1L << (i))) * (180 / 3.14159265358979) * 65536 + 0.5))
+
+static const int32_t cordic_atan[CORDIC_ITERATIONS] PROGMEM = {
+  CORDIC_ATAN(0), CORDIC_ATAN(1), CORDIC_ATAN(2), CORDIC_ATAN(3), CORDIC_ATAN(4), CORDIC_ATAN(5), CORDIC_ATAN(6),
+  CORDIC_ATAN(7), CORDIC_ATAN(8), CORDIC_ATAN(9), CORDIC_ATAN(10), CORDIC_ATAN(11), CORDIC_ATAN(12), CORDIC_ATAN(13)
+};
+
+int32_t gyro_bias_x = 0, gyro_bias_y = 0, gyro_bias_z = 0;  // Q24.8 counts, subtracted after the calibration offset
+uint8_t fusion_accel_used = 0;
+static uint8_t fusion_started = 0;
+
+// Vectoring CORDIC: rotates (x, y) onto the x axis. Returns atan2(y, x) and leaves
+// CORDIC gain * sqrt(x^2 + y^2) in *magnitude
+static angle_q16_t cordic_atan2(int32_t y, int32_t x, int32_t *magnitude)
+{
+  angle_q16_t angle = 0;
+
+  if(x < 0) {  // Rotate into the right half plane first, CORDIC only converges within +-99 degrees
+    int32_t t = x;
+    if(y >= 0) {
+      x = y;
+      y = -t;
+      angle = ANGLE_Q16(90);
+    } else {
+      x = -y;
+      y = t;
+      angle = -ANGLE_Q16(90);
+    }
+  }
+
+  for(uint8_t i = 0; i < CORDIC_ITERATIONS; i++) {
+    int32_t xs = x >> i, ys = y >> i;
+    int32_t step = pgm_read_dword(&cordic_atan[i]);
+
+    if(y > 0) {
+      x += ys;
+      y -= xs;
+      angle += step;
+    } else {
+      x -= ys;
+      y += xs;
+      angle -= step;
+    }
+  }
+
+  *magnitude = x;
+  return angle;
+}
+
+static inline angle_q16_t wrap_angle(angle_q16_t angle)
+{
+  if(angle > ANGLE_Q16(180))
+    return angle - ANGLE_Q16(360);
+  if(angle < -ANGLE_Q16(180))
+    return angle + ANGLE_Q16(360);
+  return angle;
+}
+
+static inline int16_t remove_bias(int16_t counts, int32_t bias)
+{
+  return counts - (int16_t)((bias + 128) >> 8);
+}
+
+static inline int32_t clamp_bias(int32_t bias)
+{
+  if(bias > FUSION_BIAS_LIMIT)
+    return FUSION_BIAS_LIMIT;
+  if(bias < -FUSION_BIAS_LIMIT)
+    return -FUSION_BIAS_LIMIT;
+  return bias;
+}
+
+void imu_fusion_init(void)
+{
+  gyro_bias_x = 0;
+  gyro_bias_y = 0;
+  gyro_bias_z = 0;
+  fusion_started = 0;
+}
+
+void imu_fusion_update(const imu_fifo_sample_t *sample, uint16_t dt_us, angle_q16_t *roll, angle_q16_t *pitch, angle_q16_t *yaw)
+{
+  int32_t yz_magnitude, magnitude;
+
+  gyro_x = remove_bias(sample->gyro_x - gyro_offset_x, gyro_bias_x);
+  gyro_y = remove_bias(sample->gyro_y - gyro_offset_y, gyro_bias_y);
+  gyro_z = remove_bias(sample->gyro_z - gyro_offset_z, gyro_bias_z);
+  accel_x = sample->accel_x - accel_offset_x;
+  accel_y = sample->accel_y - accel_offset_y;
+  accel_z = sample->accel_z - accel_offset_z;
+
+  *roll += gyro_rate_to_angle(gyro_x, dt_us);
+  *pitch += gyro_rate_to_angle(gyro_y, dt_us);
+  *yaw += gyro_rate_to_angle(gyro_z, dt_us);
+
+  // roll = atan2(ay, az), pitch = atan2(-ax, sqrt(ay^2 + az^2)). The first CORDIC's magnitude carries its
+  // gain, so ax is scaled by the same gain to keep the second one's arguments consistent
+  angle_q16_t accel_roll = cordic_atan2((int32_t)accel_y << FUSION_INPUT_SHIFT, (int32_t)accel_z << FUSION_INPUT_SHIFT, &yz_magnitude);
+  angle_q16_t accel_pitch = cordic_atan2(-(((int32_t)accel_x * CORDIC_GAIN_Q14) >> (14 - FUSION_INPUT_SHIFT)), yz_magnitude, &magnitude);
+
+  int32_t g_error = magnitude - FUSION_ACCEL_1G_GAIN2;
+  fusion_accel_used = (g_error < (FUSION_ACCEL_1G_GAIN2 >> 3)) && (g_error > -(FUSION_ACCEL_1G_GAIN2 >> 3));
+
+  if(!fusion_accel_used)
+    return;
+
+  if(!fusion_started) {  // Start from the accelerometer rather than converging from level
+    fusion_started = 1;
+    *roll = accel_roll;
+    *pitch = accel_pitch;
+    return;
+  }
+
+  angle_q16_t roll_error = wrap_angle(accel_roll - *roll);
+  angle_q16_t pitch_error = wrap_angle(accel_pitch - *pitch);
+
+  *roll += roll_error >> FUSION_ACCEL_SHIFT;
+  *pitch += pitch_error >> FUSION_ACCEL_SHIFT;
+
+  // Gyro reading low -> error grows positive -> less bias subtracted
+  gyro_bias_x = clamp_bias(gyro_bias_x - (roll_error >> FUSION_BIAS_SHIFT));
+  gyro_bias_y = clamp_bias(gyro_bias_y - (pitch_error >> FUSION_BIAS_SHIFT));
+}
+
+// Drain the FIFO, either integrating the gyro only or running every sample through the fusion filter
+static uint8_t integrate_fifo(angle_q16_t *gyro_angle_x, angle_q16_t *gyro_angle_y, angle_q16_t *gyro_angle_z, uint8_t fuse)
+{
+  imu_fifo_sample_t samples[IMU_FIFO_BATCH];
+  uint8_t total = 0, n;
+
+  do {
+    PROFILE_BEGIN(imu_read);
+    n = imu_fifo_read(samples, IMU_FIFO_BATCH);
+    PROFILE_END(imu_read);
+
+    PROFILE_BEGIN(integration);
+    for(uint8_t i = 0; i < n; i++) {
+      still_update(&samples[i]);
+
+      if(fuse) {
+        imu_fusion_update(&samples[i], fifo_sample_period_us, gyro_angle_x, gyro_angle_y, gyro_angle_z);
+        continue;
+      }
+
+      gyro_x = samples[i].gyro_x - gyro_offset_x;
+      gyro_y = samples[i].gyro_y - gyro_offset_y;
+      gyro_z = samples[i].gyro_z - gyro_offset_z;
+      accel_x = samples[i].accel_x;
+      accel_y = samples[i].accel_y;
+      accel_z = samples[i].accel_z;
+
+      *gyro_angle_x += gyro_rate_to_angle(gyro_x, fifo_sample_period_us);
+      *gyro_angle_y += gyro_rate_to_angle(gyro_y, fifo_sample_period_us);
+      *gyro_angle_z += gyro_rate_to_angle(gyro_z, fifo_sample_period_us);
+    }
+    PROFILE_END(integration);
+
+    total += n;
+  } while(n == IMU_FIFO_BATCH);  // A full batch means there may be more waiting
+
+  if(still_temp_due)
+    refine_temperature();
+
+  if(total)
+    imu_sample_time = micros(); // The newest sample in the FIFO is (at most one sample period) old
+
+  return total;
+}
+
+uint8_t update_gyro_angles_fifo(angle_q16_t *gyro_angle_x, angle_q16_t *gyro_angle_y, angle_q16_t *gyro_angle_z)
+{
+  return integrate_fifo(gyro_angle_x, gyro_angle_y, gyro_angle_z, 0);
+}
+
+uint8_t update_fused_angles_fifo(angle_q16_t *roll, angle_q16_t *pitch, angle_q16_t *yaw)
+{
+  return integrate_fifo(roll, pitch, yaw, 1);
+}
@@ -10,16 +10,124 @@
 #define TEMP_OUT_H 0x41     // First byte of the 2 bytes storing temperature data
 #define ACCEL_CONFIG 0x1C
 #define GYRO_CONFIG 0x1B 
+#define SMPLRT_DIV 0x19     // Sample rate = 1kHz / (1 + SMPLRT_DIV) when the DLPF is on
+#define MPU_CONFIG 0x1A     // DLPF setting
+#define FIFO_EN 0x23        // Which sensors get written into the FIFO
+#define INT_PIN_CFG 0x37
+#define INT_ENABLE 0x38
+#define INT_STATUS 0x3A
+#define USER_CTRL 0x6A      // FIFO enable and reset bits
+#define PWR_MGMT_1 0x6B
+#define FIFO_COUNTH 0x72    // First byte of the 2 bytes storing the number of bytes in the FIFO
+#define FIFO_R_W 0x74       // Reading this register pops bytes off the FIFO
 #define F_CPU 16000000UL    // 16MHz clock frequency (for ATmega328p)
 
+#define IMU_INT_PIN PD3     // MPU INT pin, connected to INT1
+
+#define IMU_FIFO_SAMPLE_BYTES 12  // Accel xyz + gyro xyz. Temperature isn't put in the FIFO
+#define IMU_FIFO_BATCH 8          // Maximum number of samples read from the FIFO per TWI burst
+
+#define ACCEL_1G 16384      // Counts per g at the power-on accelerometer range of ±2g
+
+#define FUSION_ACCEL_SHIFT 7      // Accelerometer weight 1/128 per sample, about a 1.3s time constant at 100Hz
+#define FUSION_BIAS_SHIFT 10      // Gyro bias learning rate: 1 degree of error moves the bias 1/4 count per sample
+#define FUSION_BIAS_LIMIT (1000L << 8)  // Most the bias estimate can wander from calibration, Q24.8 counts
+
+#define IMU_CAL_VERSION 1           // Bump when imu_calibration_t changes
+#define IMU_CAL_TEMP_TOLERANCE 2720 // Recalibrate if the MPU is 8 degrees C (340 counts/degree) away from the stored temperature
+#define IMU_CAL_OK 0
+#define IMU_CAL_MISSING 1           // Nothing valid in EEPROM
+#define IMU_CAL_STALE 2             // Valid, but for another range or temperature
+
+#define IMU_STILL_GYRO_COUNTS 64    // About 0.5 deg/sec at ±250
+#define IMU_STILL_ACCEL_COUNTS 164  // About 0.01g change between samples
+#define IMU_STILL_SHIFT 6
+#define IMU_STILL_SAMPLES (1 << IMU_STILL_SHIFT)  // Still samples in a row before the offsets are refined
+
+#define IMU_FRAME_BYTES 14  // 6 bytes accel + 2 bytes temp + 6 bytes gyro
+
+// One complete sample, laid out in the same order as the MPU registers starting at ACCEL_XOUT_H
+typedef struct {
+  int16_t accel_x, accel_y, accel_z;
+  int16_t temp;
+  int16_t gyro_x, gyro_y, gyro_z;
+} imu_frame_t;
+
+// What gets stored in EEPROM
+typedef struct {
+  uint8_t version;
+  uint16_t gyro_range;
+  int16_t temp;               // Raw MPU temperature at calibration
+  int16_t gyro_offset[3];
+  int16_t accel_offset[3];
+  uint16_t crc;               // CRC-16/CCITT of everything above
+} imu_calibration_t;
+
+typedef int32_t angle_q16_t;  // Degrees in Q16.16 fixed point (1 degree = 65536)
+
+#define ANGLE_Q16(deg) ((angle_q16_t)(deg) << 16)
+#define ANGLE_Q16_TO_INT(angle) ((int16_t)(((angle) + 0x8000) >> 16))  // Rounded to whole degrees
+
+// One sample as it comes out of the FIFO
+typedef struct {
+  int16_t accel_x, accel_y, accel_z;
+  int16_t gyro_x, gyro_y, gyro_z;
+} imu_fifo_sample_t;
+
+extern volatile uint8_t imu_data_ready;   // Incremented by the data-ready interrupt
+extern uint16_t imu_fifo_overflows;       // Number of times the FIFO filled up and had to be reset
+extern volatile int16_t gyro_x, gyro_y, gyro_z; // Latest rates in counts with the bias removed
+extern int16_t accel_x, accel_y, accel_z;       // Latest accelerometer reading (FIFO mode only, offsets removed when fusing)
+extern uint8_t imu_still;                 // 1 if the craft was sitting still as of the last refinement
+extern uint16_t imu_still_refinements;    // Number of times the offsets have been refined while still
+extern uint32_t imu_sample_time;          // micros() timestamp of the latest sample
+extern int32_t gyro_bias_x, gyro_bias_y, gyro_bias_z; // Fusion filter's gyro bias estimates, Q24.8 counts on top of the calibration offset
+extern uint8_t fusion_accel_used;         // 1 if the last fusion update trusted the accelerometer
+
 void imu_init(uint16_t gyro_sensitivity);
 
-void calibrate_imu(void); // Take initial measurements and use their average as an offset for future readings
+uint16_t calibrate_imu(void); // Take initial measurements and use their average as an offset for future readings. Returns the number of frames that failed to read
+
+uint8_t imu_calibration_load(uint16_t range); // Use the offsets stored in EEPROM. Returns IMU_CAL_OK, or why they couldn't be used
+
+uint8_t imu_calibration_save(uint16_t range); // Store the current (possibly refined) offsets. Returns 1 (and stores nothing) if the last calibrate_imu() had failed frames
 
 uint8_t set_gyro_config(uint16_t range);  // Set range to ±250 deg/sec, ±500 deg/sec, ±1000 deg/sec, or ±2000 deg/sec,
 
-void read_gyro(float *gx, float *gy, float *gz);
+void read_gyro_raw(int16_t *gx, int16_t *gy, int16_t *gz); // Rates in counts with the bias removed
+
+void read_gyro(float *gx, float *gy, float *gz);          // Rates in degrees/sec (float conversion of read_gyro_raw)
+
+angle_q16_t gyro_rate_to_angle(int16_t counts, uint16_t dt_us); // Angle turned through in dt_us at a rate of counts
+
+angle_q16_t yaw_rate_to_angle(uint16_t dt_us);  // Angle the latest z rate turns through in dt_us
+
+float angle_q16_to_float(angle_q16_t angle);
+
+uint8_t read_imu_frame(imu_frame_t *frame); // Read accel, temp and gyro in one 14-byte burst. Returns TWI status
+
+uint8_t start_imu_frame(imu_frame_t *frame); // Start the same burst in the background. frame is only valid once imu_frame_ready() returns 1
+
+uint8_t imu_frame_ready(void);              // 1 once the frame started by start_imu_frame() has arrived intact
+
+uint8_t imu_frame_status(void);             // TWI_PENDING while it's on the bus, then its TWI status. Nonzero means it failed and won't become ready
+
+void update_gyro_angles(float *gyro_angle_x, float *gyro_angle_y, float *gyro_angle_z); // Update last angles reading, using the measured time since the last reading
+
+void update_gyro_angles_fx(angle_q16_t *gyro_angle_x, angle_q16_t *gyro_angle_y, angle_q16_t *gyro_angle_z); // Same, without floats
+
+uint8_t imu_fifo_init(uint8_t sample_rate_div);  // Stream accel and gyro samples into the FIFO at 1kHz / (1 + sample_rate_div)
+
+uint8_t imu_fifo_read(imu_fifo_sample_t *samples, uint8_t max_samples); // Pop up to max_samples (at most IMU_FIFO_BATCH) samples. Returns the number read
+
+void imu_data_taken(uint8_t n);             // n samples have left the FIFO: take them off imu_data_ready
+
+uint8_t update_gyro_angles_fifo(angle_q16_t *gyro_angle_x, angle_q16_t *gyro_angle_y, angle_q16_t *gyro_angle_z); // Integrate every sample waiting in the FIFO. Returns the number of samples used
+
+void imu_fusion_init(void);  // Reset the bias estimates. Call after calibrate_imu()
+
+void imu_fusion_update(const imu_fifo_sample_t *sample, uint16_t dt_us, angle_q16_t *roll, angle_q16_t *pitch, angle_q16_t *yaw); // One raw sample through the complementary filter
 
-void update_gyro_angles(float dt, float *gyro_angle_x, float *gyro_angle_y, float *gyro_angle_z); // Update last angles reading. dt should be in seconds
+uint8_t update_fused_angles_fifo(angle_q16_t *roll, angle_q16_t *pitch, angle_q16_t *yaw); // Same as update_gyro_angles_fifo(), through the fusion filter
 
 #endif
\ No newline at end of file
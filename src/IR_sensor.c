@@ -0,0 +1,88 @@
+#include "IR_sensor.h"
+#include "profiler.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define IR_MASK (IR_BUFFER_SIZE - 1)
+
+volatile uint8_t ir_overruns = 0;
+
+static volatile uint16_t ir_buffer[IR_BUFFER_SIZE];
+static volatile uint8_t ir_head = 0;     // Written by the ISR
+static volatile uint8_t ir_tail = 0;     // Written by IR_read()
+
+static uint16_t ir_sum = 0;
+static uint8_t ir_samples = 0;
+
+static uint8_t bar_seen = 0;
+static uint8_t bar_count = 0;            // Results in a row disagreeing with bar_seen
+
+// Every conversion, ~9.6kHz. Short: an add, and every IR_OVERSAMPLE conversions a buffer write
+ISR(ADC_vect)
+{
+  PROFILE_BEGIN(adc);
+
+  ir_sum += ADC;
+
+  if(++ir_samples == IR_OVERSAMPLE) {
+    uint8_t next = (ir_head + 1) & IR_MASK;
+
+    if(next != ir_tail) {
+      ir_buffer[ir_head] = ir_sum >> IR_RESULT_SHIFT;
+      ir_head = next;
+    } else if(ir_overruns != 0xFF) {
+      ir_overruns++;
+    }
+
+    ir_sum = 0;
+    ir_samples = 0;
+  }
+
+  PROFILE_END(adc);
+}
+
+void IR_init()
+{
+  ADMUX = (1 << REFS0) | IR_CHANNEL;  // AVCC reference (external capacitor at AREF), right adjusted for all 10 bits
+  ADCSRB = 0;                         // Free running: each conversion starts the next
+  DIDR0 |= (1 << IR_CHANNEL);         // No digital input buffer on the analog pin
+
+  // Prescaler 128 for a 125kHz ADC clock, enable, auto trigger, interrupt, and start the first conversion
+  ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
+
+uint8_t IR_read(uint16_t *reading)
+{
+  uint8_t tail = ir_tail;
+
+  if(tail == ir_head)
+    return 0;
+
+  *reading = ir_buffer[tail];  // 16 bits, but safe: the ISR won't touch this slot until ir_tail moves past it
+  ir_tail = (tail + 1) & IR_MASK;
+
+  return 1;
+}
+
+uint8_t IR_bar_update(uint16_t window_min, uint16_t window_max)
+{
+  uint16_t reading;
+
+  while(IR_read(&reading)) {
+    uint8_t inside;
+
+    if(bar_seen || bar_count)
+      inside = reading + IR_HYSTERESIS >= window_min && reading <= window_max + IR_HYSTERESIS;
+    else
+      inside = reading >= window_min && reading <= window_max;
+
+    if(inside == bar_seen) {
+      bar_count = 0;
+    } else if(++bar_count >= IR_CONFIRM) {
+      bar_seen = inside;
+      bar_count = 0;
+    }
+  }
+
+  return bar_seen;
+}
@@ -0,0 +1,34 @@
+#ifndef IR_SENSOR_H
+#define IR_SENSOR_H
+
+#include <inttypes.h>
+
+/*
+  Upward-looking IR sensor on "P5" on the ENCS board (PC0, ADC0), used to spot the bar over the end of
+  the course. The ADC free runs and ADC_vect adds up IR_OVERSAMPLE conversions into one 12-bit result, so
+  nothing ever waits on a conversion. Results go into a small ring buffer that IR_bar_update() drains.
+
+  The bar detector needs IR_CONFIRM results in a row inside the window before it reports the bar, and
+  the same number outside the (wider, by IR_HYSTERESIS) window before it lets it go again. A single
+  noisy reading does nothing either way.
+*/
+
+#define IR_CHANNEL 0
+
+#define IR_OVERSAMPLE 64          // Conversions per result. 125kHz ADC clock / 13 / 64 = ~150 results/s
+#define IR_RESULT_SHIFT 4         // 64 10-bit readings add up to 16 bits; keep the top 12
+#define IR_BUFFER_SIZE 16         // Results. Must be a power of 2, at most 256
+
+#define IR_READING(adch) ((uint16_t)(adch) << 4)  // An 8-bit ADCH value on the 12-bit result scale
+#define IR_HYSTERESIS IR_READING(3)               // Once counting, the window widens by this much either side
+#define IR_CONFIRM 8                              // Results in a row (~50ms) before the bar counts as seen
+
+extern volatile uint8_t ir_overruns;      // Results lost because the buffer was full
+
+void IR_init();                           // Start the ADC free running on IR_CHANNEL
+
+uint8_t IR_read(uint16_t *reading);       // Oldest buffered result (0-4095). Returns 0 if there isn't one
+
+uint8_t IR_bar_update(uint16_t window_min, uint16_t window_max);  // Drain the buffer through the bar detector. Returns 1 while the bar is confirmed overhead
+
+#endif
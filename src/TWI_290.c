@@ -1,5 +1,7 @@
 #include "TWI_290.h"
+#include "profiler.h"
 #include <util/twi.h>
+#include <avr/interrupt.h>
 
 /*
   This code was written by Dmitry and posted to the Moodle course page. I have added some IMU-related comments
@@ -34,7 +36,7 @@ uint8_t TWI_start(uint8_t twi_addr, uint8_t read_write) {
 
 	TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN); //send START condition
 	
-  while(!(TWCR & (1 << TWINT))); //wait until transmission completed
+	while(!(TWCR & (1 << TWINT))); //wait until transmission completed
 
 	if (((TWSR & 0xF8) != TW_START) && ((TWSR & 0xF8) != TW_REP_START)) 
     return 1; //something went wrong
@@ -99,86 +101,199 @@ uint8_t TWI_nack_read(void) //read and stop condition
 }
 
 
-uint8_t Read_Reg(uint8_t TWI_addr, uint8_t reg_addr){
+/*
+  The functions above busy-wait on TWINT for every byte. The transaction engine below does the same
+  work from the TWI interrupt instead, one bus event per interrupt, so a register read can be started
+  and then left to finish in the background. The blocking Read_Reg/Read_Reg_N/Write_Reg functions
+  are now thin wrappers around it.
+  Don't mix the raw functions above with queued transactions: only use them while TWI_busy() is 0.
+*/
 
-	TWI_status = TWI_start(TWI_addr, TW_WRITE);
-	if(TWI_status) 
-    return 1;
+// What the engine is waiting for on the next TWI interrupt
+#define TWI_STAGE_SLA_W 0   // START sent, device address + write next
+#define TWI_STAGE_REG 1     // Address acknowledged, register number next
+#define TWI_STAGE_WRITE 2   // Writing data bytes
+#define TWI_STAGE_SLA_R 3   // Repeated START sent, device address + read next
+#define TWI_STAGE_READ 4    // Reading data bytes
 
-	TWI_status = TWI_write(reg_addr); //  register #
-	if(TWI_status)
-    return 2;
+#define TWCR_START ((1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE))
+#define TWCR_NEXT ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+
+static twi_transaction_t *volatile twi_queue[TWI_QUEUE_SIZE];
+static volatile uint8_t twi_queue_head = 0, twi_queue_count = 0;
+static volatile uint8_t twi_stage, twi_index;
 
-	TWI_status = TWI_start(TWI_addr, TW_READ);
-	if(TWI_status) 
-    return 3;
+// Complete the transaction at the head of the queue and start the next one (if there is one)
+static void twi_finish(uint8_t status)
+{
+  twi_transaction_t *t = twi_queue[twi_queue_head];
 
-	TWI_byte = TWI_nack_read();
+  twi_queue_head = (twi_queue_head + 1) & (TWI_QUEUE_SIZE - 1);
+  twi_queue_count--;
 
-	TWI_stop();
+  twi_stage = TWI_STAGE_SLA_W;
+  twi_index = 0;
 
-  //return TWI_byte;
-	if(!flags.TWI_ACK)
-    return 4;
+  if(twi_queue_count)
+    TWCR = TWCR_START | (1 << TWSTO); // STOP followed directly by a START for the next transaction
+  else
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO); // STOP and release the bus
 
-	return 0;
+  t->status = status;
+  if(t->callback)
+    t->callback(t);
 }
 
+// Handle one bus event. Called from the ISR, or by TWI_wait() when interrupts are disabled
+static void twi_service(void)
+{
+  twi_transaction_t *t = twi_queue[twi_queue_head];
+
+  switch(TWSR & 0xF8) {
+    case TW_START:
+    case TW_REP_START:
+      TWDR = (t->address << 1) | (twi_stage == TWI_STAGE_SLA_R ? TW_READ : TW_WRITE);
+      TWCR = TWCR_NEXT;
+      break;
+
+    case TW_MT_SLA_ACK:
+      TWDR = t->reg;
+      twi_stage = TWI_STAGE_REG;
+      TWCR = TWCR_NEXT;
+      break;
+
+    case TW_MT_DATA_ACK:
+      if(twi_stage == TWI_STAGE_REG && t->read_write == TW_READ) {
+        twi_stage = TWI_STAGE_SLA_R;
+        TWCR = TWCR_START;  // Repeated START to switch to reading
+      }
+      else if(twi_index < t->length) {
+        twi_stage = TWI_STAGE_WRITE;
+        TWDR = t->buffer[twi_index++];
+        TWCR = TWCR_NEXT;
+      }
+      else {
+        twi_finish(0);
+      }
+      break;
+
+    case TW_MR_SLA_ACK:
+      twi_stage = TWI_STAGE_READ;
+      // ACK every byte except the last one
+      TWCR = (t->length > 1) ? (TWCR_NEXT | (1 << TWEA)) : TWCR_NEXT;
+      break;
+
+    case TW_MR_DATA_ACK:
+      t->buffer[twi_index++] = TWDR;
+      TWCR = (twi_index < t->length - 1) ? (TWCR_NEXT | (1 << TWEA)) : TWCR_NEXT;
+      break;
+
+    case TW_MR_DATA_NACK:
+      t->buffer[twi_index++] = TWDR;
+      twi_finish(0);
+      break;
+
+    default:
+      // NACK, lost arbitration or bus error. Use the same codes as the blocking functions
+      switch(twi_stage) {
+        case TWI_STAGE_SLA_W: twi_finish(1); break;
+        case TWI_STAGE_REG:   twi_finish(2); break;
+        case TWI_STAGE_WRITE:
+        case TWI_STAGE_SLA_R: twi_finish(3); break;
+        default:              twi_finish(twi_index == t->length - 1 ? 4 : 5); break;
+      }
+  }
+}
 
-uint8_t Read_Reg_N(uint8_t TWI_addr, uint8_t reg_addr, uint8_t bytes, int16_t* data){ 
-	
-	uint8_t *p_data = (uint8_t*)data;
+ISR(TWI_vect)
+{
+  PROFILE_BEGIN(twi);
+  twi_service();
+  PROFILE_END(twi);
+}
+
+uint8_t TWI_submit(twi_transaction_t *t)
+{
+  uint8_t sreg = SREG;
+  cli();
 
-	TWI_status = TWI_start(TWI_addr, TW_WRITE);
-	if(TWI_status) 
+  if(twi_queue_count == TWI_QUEUE_SIZE) {
+    SREG = sreg;
     return 1;
+  }
 
-	TWI_status = TWI_write(reg_addr); //  register #
-	if(TWI_status)
-    return 2;
+  t->status = TWI_PENDING;
+  twi_queue[(twi_queue_head + twi_queue_count) & (TWI_QUEUE_SIZE - 1)] = t;
+
+  if(twi_queue_count++ == 0) {
+    // Bus is idle: wait for any previous STOP to go out, then kick off this transaction
+    while(TWCR & (1 << TWSTO));
+    twi_stage = TWI_STAGE_SLA_W;
+    twi_index = 0;
+    TWCR = TWCR_START;
+  }
+
+  SREG = sreg;
+  return 0;
+}
+
+uint8_t TWI_busy(void)
+{
+  return twi_queue_count != 0;
+}
 
-	TWI_status = TWI_start(TWI_addr, TW_READ);
-	if(TWI_status)
-    return 3;
-//	p_data=(uint8_t*)data;	
-	for(uint8_t i = 0; i < bytes-1; i++) {
-		*p_data = TWI_ack_read();
-		if(!flags.TWI_ACK) 
-      return 5;
-		p_data++;	
-	}
+// With interrupts disabled the ISR can't run, so step the state machine by hand
+static void twi_poll(void)
+{
+  if(!(SREG & (1 << SREG_I)) && (TWCR & (1 << TWINT)) && twi_queue_count)
+    twi_service();
+}
 
-	*p_data = TWI_nack_read();
+uint8_t TWI_wait(twi_transaction_t *t)
+{
+  while(t->status == TWI_PENDING)
+    twi_poll();
 
-	TWI_stop();
+  return t->status;
+}
 
-	if(!flags.TWI_ACK)
-    return 4;
+// Queue a transaction and wait for it (waiting for queue space first if needed)
+static uint8_t twi_run(twi_transaction_t *t)
+{
+  while(TWI_submit(t))
+    twi_poll();
 
-	return 0;
+  return TWI_wait(t);
 }
 
 
-uint8_t Write_Reg(uint8_t TWI_addr, uint8_t reg_addr, uint8_t value) {
+uint8_t Read_Reg(uint8_t TWI_addr, uint8_t reg_addr){
 
-	TWI_status = TWI_start(TWI_addr, TW_WRITE);
-	if(TWI_status) 
-    return 1;
+	twi_transaction_t t = {TWI_addr, reg_addr, TW_READ, 1, (uint8_t*)&TWI_byte, TWI_PENDING, 0};
 
-	TWI_status = TWI_write(reg_addr); //  register #
-	if(TWI_status) 
-    return 2;
+	TWI_status = twi_run(&t);
 
-	TWI_status = TWI_write(value); // write the value
-	if(TWI_status) 
-    return 3;
+	return TWI_status;
+}
 
-	TWI_stop();
 
-	if(!flags.TWI_ACK) 
-    return 4;
+uint8_t Read_Reg_N(uint8_t TWI_addr, uint8_t reg_addr, uint8_t bytes, int16_t* data){ 
 
-	return 0;
+	twi_transaction_t t = {TWI_addr, reg_addr, TW_READ, bytes, (uint8_t*)data, TWI_PENDING, 0};
+
+	TWI_status = twi_run(&t);
+
+	return TWI_status;
+}
+
+
+uint8_t Write_Reg(uint8_t TWI_addr, uint8_t reg_addr, uint8_t value) {
+
+	twi_transaction_t t = {TWI_addr, reg_addr, TW_WRITE, 1, &value, TWI_PENDING, 0};
+
+	TWI_status = twi_run(&t);
+
+	return TWI_status;
 }
 
 //=============================== TWI functions end ===================
@@ -23,4 +23,37 @@ uint8_t Read_Reg_N(uint8_t TWI_addr, uint8_t reg_addr, uint8_t bytes, int16_t* d
 
 uint8_t Write_Reg(uint8_t TWI_addr, uint8_t reg_addr, uint8_t value);
 
+//=============================== Interrupt-driven transactions ======================
+
+#define TWI_QUEUE_SIZE 4      // Maximum number of transactions waiting for the bus
+#define TWI_PENDING 0xFF      // Status of a transaction that hasn't completed yet
+
+/*
+  Describes one register read or write. The descriptor (and its buffer) must stay alive until
+  status is no longer TWI_PENDING. Error codes are the ones Read_Reg/Read_Reg_N/Write_Reg have always
+  returned:
+    1  no START, or the device didn't acknowledge its address (TWI_start() itself says 2 for that)
+    2  register number not acknowledged
+    3  repeated START or the read address failed (reads), or the data byte wasn't acknowledged (writes)
+    4  the last byte of a read failed
+    5  an earlier byte of a read failed
+  TWI_status is now the same code as the blocking functions return. It used to be the code of the raw
+  step that failed, so an address NACK left it at 2 rather than 1. Nothing in the firmware reads it.
+*/
+typedef struct twi_transaction {
+  uint8_t address;            // 7-bit device address
+  uint8_t reg;                // First register to read from/write to
+  uint8_t read_write;         // TW_READ or TW_WRITE
+  uint8_t length;             // Number of data bytes
+  uint8_t *buffer;            // Data to write or space for data read
+  volatile uint8_t status;    // TWI_PENDING, then 0 on success or an error code
+  void (*callback)(struct twi_transaction *t);  // Optional, called from the TWI ISR on completion
+} twi_transaction_t;
+
+uint8_t TWI_submit(twi_transaction_t *t); // Queue a transaction. Returns 1 if the queue is full
+
+uint8_t TWI_busy(void);                   // 1 while any transaction is queued or in progress
+
+uint8_t TWI_wait(twi_transaction_t *t);   // Block until t completes and return its status
+
 #endif
\ No newline at end of file
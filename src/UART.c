@@ -2,24 +2,89 @@
   I got a lot of the code and information in this program from http://www.rjhcoding.com/avrc-uart.php
 */
 #include <avr/io.h>
-#include <stdio.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stdarg.h>
 #include "UART.h"
+#include "profiler.h"
 
-#define F_CPU 16000000L
-#define UBRR_9600 103
+#define UBRR_9600 UART_UBRR(9600)  // 103
 
-void uart_init(uint16_t baudRate)
+#define TX_MASK (UART_TX_BUFFER_SIZE - 1)
+#define RX_MASK (UART_RX_BUFFER_SIZE - 1)
+
+static volatile uint8_t tx_buffer[UART_TX_BUFFER_SIZE];
+static volatile uint8_t tx_head = 0;  // Next free slot
+static volatile uint8_t tx_tail = 0;  // Next character to send
+static uint8_t tx_mode = UART_TX_DROP;
+
+static volatile uint8_t rx_buffer[UART_RX_BUFFER_SIZE];
+static volatile uint8_t rx_head = 0;  // Written by the ISR
+static volatile uint8_t rx_tail = 0;  // Next character to hand out
+
+volatile uint16_t uart_tx_full = 0;
+volatile uint16_t uart_tx_dropped = 0;
+volatile uint16_t uart_rx_lost = 0;
+
+// Hand the next queued character to the UART. Called from the ISR, or directly while interrupts are off
+static void tx_next()
+{
+    if(tx_head != tx_tail) {
+        UDR0 = tx_buffer[tx_tail];
+        tx_tail = (tx_tail + 1) & TX_MASK;
+    }
+
+    if(tx_head == tx_tail)
+        UCSR0B &= ~(1 << UDRIE0); // Nothing left to send
+}
+
+ISR(USART_UDRE_vect)
+{
+    PROFILE_BEGIN(usart_udre);
+    tx_next();
+    PROFILE_END(usart_udre);
+}
+
+ISR(USART_RX_vect)
+{
+    PROFILE_BEGIN(usart_rx);
+
+    uint8_t overrun = UCSR0A & (1 << DOR0); // Has to be read before UDR0
+    uint8_t c = UDR0;
+    uint8_t next = (rx_head + 1) & RX_MASK;
+
+    if(overrun)
+        uart_rx_lost++;
+
+    if(next != rx_tail) {
+        rx_buffer[rx_head] = c;
+        rx_head = next;
+    } else {
+        uart_rx_lost++;
+    }
+
+    PROFILE_END(usart_rx);
+}
+
+// Wait for the buffer to drain by one character. If interrupts are disabled the ISR can't do it for us
+static void tx_wait()
 {
-    // Set the baud rate (baud rate is symbols per second, or pulses per second)
-    // Using the equation in the data sheet, the value in the baud rate register should be:
-    uint16_t ubrr = F_CPU / 16 / baudRate - 1;
+    if(!(SREG & (1 << SREG_I)) && (UCSR0A & (1 << UDRE0)))
+        tx_next();
+}
+
+void uart_init_ubrr(uint16_t ubrr)
+{
+    // The baud rate (baud rate is symbols per second, or pulses per second) sets the value in the
+    // baud rate register using the equation in the data sheet. UART_UBRR() in convert.h works it
+    // out at compile time, since the ATMEGA328P does not have a hardware divider
 
     // Write value to baud rate registers
     UBRR0L = (uint8_t)(ubrr & 0xFF);
     UBRR0H = (uint8_t)(ubrr >> 8);
 
-    // Enable the transmitter and receiver
-    UCSR0B |= (1 << RXEN0) | (1 << TXEN0);
+    // Enable the transmitter, and the receiver with its interrupt
+    UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 }
 
 // ATMEGA328P does not have a hardware divider, so division is very expensive. This alternative
@@ -32,18 +97,52 @@ void uart_init_9600()
     UBRR0L = (uint8_t)(ubrr & 0xFF);
     UBRR0H = (uint8_t)(ubrr >> 8);
 
-    // Enable the transmitter and receiver
-    UCSR0B |= (1 << RXEN0) | (1 << TXEN0);
+    // Enable the transmitter, and the receiver with its interrupt
+    UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 }
 
 //*************** Character and string transmission ***************
+void uart_txMode(uint8_t mode)
+{
+    tx_mode = mode;
+}
+
+void uart_txFlush()
+{
+    while(tx_head != tx_tail)
+        tx_wait();
+}
+
+uint8_t uart_txFree()
+{
+    return (tx_tail - tx_head - 1) & TX_MASK;
+}
+
+uint8_t uart_txRoom(uint8_t count)
+{
+    return tx_mode == UART_TX_BLOCK || uart_txFree() >= count;
+}
+
 void uart_txChar(unsigned char c)
 {
-    // Wait while the transmit buffer is not empty
-    while (!(UCSR0A & (1 << UDRE0)));
+    uint8_t next = (tx_head + 1) & TX_MASK;
+
+    if(next == tx_tail) {
+        uart_tx_full++;
+
+        if(tx_mode == UART_TX_DROP) {
+            uart_tx_dropped++;
+            return;
+        }
+
+        while(next == tx_tail)
+            tx_wait();
+    }
 
-    // Load data into transmit register
-    UDR0 = c;
+    // Queue the character and make sure the UDRE interrupt is on to send it
+    tx_buffer[tx_head] = c;
+    tx_head = next;
+    UCSR0B |= (1 << UDRIE0);
 }
 
 void uart_txString(const char* s)
@@ -54,6 +153,23 @@ void uart_txString(const char* s)
     }
 }
 
+//*************** Reception ***************
+
+uint8_t uart_rxReady()
+{
+    return rx_head != rx_tail;
+}
+
+unsigned char uart_rxChar()
+{
+    while(!uart_rxReady());
+
+    uint8_t c = rx_buffer[rx_tail];
+    rx_tail = (rx_tail + 1) & RX_MASK;
+
+    return c;
+}
+
 //*************** Integer transmission ***************
 
 // This function was written by the author of: http://www.rjhcoding.com/avrc-uart.php
@@ -136,14 +252,194 @@ void uart_txU16(uint16_t val)
     uart_txChar(val + '0');
 }
 
-void uart_txFormatted(const char* format, ...) 
+//*************** Formatted transmission ***************
+
+/*
+  A small printf that sends straight to the UART instead of going through vsnprintf and a buffer. Like
+  uart_txU16, digits come from subtracting powers of ten, so there's no division anywhere.
+*/
+
+static const uint32_t powers_of_10[] PROGMEM = {
+    1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10
+};
+
+#define POWERS_OF_10 (sizeof(powers_of_10) / sizeof(powers_of_10[0]))
+
+// 10^decimals, for %q
+static const uint16_t q16_scale[UART_Q16_MAX_DECIMALS + 1] PROGMEM = {
+    1, 10, 100, 1000, 10000
+};
+
+static void tx_padding(uint8_t width, uint8_t length, char pad)
+{
+    while(width-- > length)
+        uart_txChar(pad);
+}
+
+// sign is '-' or 0. The padding goes after the sign when it's zeros, before it when it's spaces
+static void tx_decimal(uint32_t value, char sign, uint8_t width, char pad)
+{
+    uint8_t first = 0;
+
+    // Skip the powers bigger than value; what's left (plus the units) is the number of digits
+    while(first < POWERS_OF_10 && value < pgm_read_dword(&powers_of_10[first]))
+        first++;
+
+    uint8_t length = POWERS_OF_10 - first + 1 + (sign != 0);
+
+    if(sign && pad == '0')
+        uart_txChar(sign);
+    tx_padding(width, length, pad);
+    if(sign && pad != '0')
+        uart_txChar(sign);
+
+    for(uint8_t i = first; i < POWERS_OF_10; i++) {
+        uint32_t power = pgm_read_dword(&powers_of_10[i]);
+        char digit = '0';
+
+        while(value >= power) {
+            value -= power;
+            digit++;
+        }
+
+        uart_txChar(digit);
+    }
+
+    uart_txChar('0' + value);
+}
+
+static void tx_hex(uint32_t value, uint8_t width, char pad, char a)
+{
+    uint8_t length = 1;
+
+    while(length < 8 && (value >> (length << 2)))
+        length++;
+
+    tx_padding(width, length, pad);
+
+    while(length--) {
+        uint8_t nibble = (value >> (length << 2)) & 0x0F;
+        uart_txChar(nibble < 10 ? '0' + nibble : a + nibble - 10);
+    }
+}
+
+// Q16.16 with a fixed number of decimals. The fraction is scaled to 10^decimals and rounded (a
+// multiply and a shift), then printed as a zero-padded integer
+static void tx_q16(int32_t value, uint8_t decimals, uint8_t width, char pad)
+{
+    char sign = (value < 0) ? '-' : 0;
+    uint32_t magnitude = (value < 0) ? -(uint32_t)value : (uint32_t)value;
+
+    if(decimals > UART_Q16_MAX_DECIMALS)
+        decimals = UART_Q16_MAX_DECIMALS;
+
+    uint16_t scale = pgm_read_word(&q16_scale[decimals]);
+    uint32_t whole = magnitude >> 16;
+    uint32_t fraction = ((magnitude & 0xFFFF) * scale + 0x8000) >> 16;
+
+    if(fraction >= scale) {   // Rounded up into the next whole number
+        fraction -= scale;
+        whole++;
+    }
+
+    uint8_t fraction_width = decimals ? decimals + 1 : 0;
+    tx_decimal(whole, sign, (width > fraction_width) ? width - fraction_width : 0, pad);
+
+    if(decimals) {
+        uart_txChar('.');
+        tx_decimal(fraction, 0, decimals, '0');
+    }
+}
+
+static void tx_formatted(const char *format, uint8_t in_flash, va_list args)
+{
+    char c;
+
+    while((c = in_flash ? pgm_read_byte(format) : *format)) {
+        format++;
+
+        if(c != '%') {
+            uart_txChar(c);
+            continue;
+        }
+
+        char pad = ' ';
+        uint8_t width = 0, precision = UART_Q16_DEFAULT_DECIMALS, is_long = 0;
+
+        #define NEXT() (c = in_flash ? pgm_read_byte(format++) : *format++)
+
+        NEXT();
+        if(c == '0') {
+            pad = '0';
+            NEXT();
+        }
+        while(c >= '0' && c <= '9') {
+            width = (width << 3) + (width << 1) + (c - '0');
+            NEXT();
+        }
+        if(c == '.') {
+            precision = 0;
+            while(NEXT() >= '0' && c <= '9')
+                precision = (precision << 3) + (precision << 1) + (c - '0');
+        }
+        if(c == 'l') {
+            is_long = 1;
+            NEXT();
+        }
+
+        #undef NEXT
+
+        switch(c) {
+            case 'd':
+            case 'i': {
+                int32_t value = is_long ? va_arg(args, long) : va_arg(args, int);
+                tx_decimal((value < 0) ? -(uint32_t)value : (uint32_t)value, (value < 0) ? '-' : 0, width, pad);
+                break;
+            }
+            case 'u':
+                tx_decimal(is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int), 0, width, pad);
+                break;
+            case 'x':
+            case 'X':
+                tx_hex(is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int), width, pad, c - 'X' + 'A');
+                break;
+            case 'q':
+                tx_q16(va_arg(args, int32_t), precision, width, pad);
+                break;
+            case 'c':
+                uart_txChar(va_arg(args, int));
+                break;
+            case 's':
+                uart_txString(va_arg(args, const char*));
+                break;
+            case 'S': {
+                const char *s = va_arg(args, const char*);
+                while((c = pgm_read_byte(s++)))
+                    uart_txChar(c);
+                break;
+            }
+            case '\0':
+                return;   // Format ended in the middle of a conversion
+            default:
+                uart_txChar(c);   // Including %%
+        }
+    }
+}
+
+void uart_txFormatted(const char* format, ...)
 {
-    char buffer[64];
     va_list args;
 
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    tx_formatted(format, 0, args);
     va_end(args);
+}
+
+void uart_txFormatted_P(const char* format, ...)
+{
+    va_list args;
 
-    uart_txString(buffer);
+    va_start(args, format);
+    tx_formatted(format, 1, args);
+    va_end(args);
 }
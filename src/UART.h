@@ -1,10 +1,40 @@
 #ifndef uart_h
 #define uart_h
 
-void uart_init(uint16_t baudRate);              // Initialise with the passed baud rate
+#include <inttypes.h>
+#include "convert.h"
+
+// Characters are queued and sent by the UDRE interrupt, so transmitting doesn't wait on the UART
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 64  // Must be a power of 2, at most 256
+#endif
+
+// Received characters are buffered by the RX interrupt until uart_rxChar() takes them
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 32  // Must be a power of 2, at most 256
+#endif
+
+#define UART_TX_DROP 0          // When the buffer is full, throw the character away
+#define UART_TX_BLOCK 1         // When the buffer is full, wait for space
+
+extern volatile uint16_t uart_tx_full;    // Number of characters that found the buffer full
+extern volatile uint16_t uart_tx_dropped; // Number of those that were thrown away
+extern volatile uint16_t uart_rx_lost;    // Received characters lost, to a full buffer or a UART overrun
+
+void uart_init_ubrr(uint16_t ubrr);             // Initialise with a UBRR value
+
+#define uart_init(baudRate) uart_init_ubrr(UART_UBRR(baudRate)) // Initialise with the passed baud rate (UBRR worked out at compile time)
 
 void uart_init_9600();                          // Initialise with a baud rate of 9600
 
+void uart_txMode(uint8_t mode);                 // UART_TX_DROP (default) or UART_TX_BLOCK
+
+void uart_txFlush();                            // Wait until everything queued has been handed to the UART
+
+uint8_t uart_txFree();                          // Characters that can be queued right now without dropping or waiting
+
+uint8_t uart_txRoom(uint8_t count);             // 1 if count characters would all be sent: there's space, or UART_TX_BLOCK waits for it
+
 void uart_txChar(unsigned char c);              // Transmit char
 
 void uart_txString(const char* s);              // Transmit string
@@ -13,6 +43,20 @@ void uart_txU8(uint8_t val);                    // Transmit 8-bit unsigned int
 
 void uart_txU16(uint16_t val);                  // Transmit 16-bit unsigned int
 
-void uart_txFormatted(const char* format, ...); // Transmit formatted output
+/*
+  Formatted output, without vsnprintf or a buffer. Conversions are %d %i %u %x %X (add l for long),
+  %c, %s, %S (string in flash), %% and %q: a Q16.16 fixed point value (angle_q16_t) with .N decimals,
+  2 by default, at most UART_Q16_MAX_DECIMALS. A 0 flag and a width are understood, nothing else.
+*/
+#define UART_Q16_DEFAULT_DECIMALS 2
+#define UART_Q16_MAX_DECIMALS 4
+
+void uart_txFormatted(const char* format, ...);   // Transmit formatted output
+
+void uart_txFormatted_P(const char* format, ...); // Same, with the format string in flash (PSTR())
+
+uint8_t uart_rxReady();                         // 1 if a received character is waiting in the buffer
+
+unsigned char uart_rxChar();                    // Receive char (waits for one)
 
 #endif
\ No newline at end of file
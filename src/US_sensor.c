@@ -1,47 +1,67 @@
 #include "US_sensor.h"
-#include "UART.h"
+#include "timebase.h"
+#include "convert.h"
+#include "profiler.h"
 
-volatile uint8_t timer_2_overflow_count = 0;
-volatile uint16_t echo_duration = 0; // Duration of the echo signal in timer ticks
-volatile bool echo_complete = false; // Flag to indicate echo completion
+/*
+  Measurements run in the background: US_start() fires the trigger, INT0 timestamps both edges
+  of the echo with micros(), and the falling edge completes the result. Nothing waits for the
+  sensor. US_poll() catches measurements that never finish.
+*/
+
+static volatile uint8_t us_state = US_IDLE;
+static volatile bool echo_started = false;  // Rising edge seen for the current measurement
+static volatile uint32_t trigger_time = 0;  // micros() when the trigger pulse was sent
+static volatile uint32_t echo_start = 0;    // micros() at the rising edge of the echo
+static volatile us_result_t us_result;
+static volatile bool us_result_new = false;
+
+// Finish the current measurement. Called with interrupts disabled
+static void US_complete(uint8_t status, uint16_t echo_us, uint32_t now)
+{
+  us_result.status = status;
+  us_result.echo_us = echo_us;
+  us_result.timestamp = now;
+  us_result.seq++;
+  us_result_new = true;
+  us_state = US_IDLE;
+}
 
 ISR(INT0_vect)
 { 
-  if (!echo_complete) // Rising edge
+  uint32_t now = micros();
+
+  PROFILE_BEGIN(int0);
+
+  if(us_state != US_BUSY) {
+    PROFILE_END(int0);
+    return;
+  }
+
+  if(PIND & (1 << ECHO_PIN)) // Rising edge
   { 
-      TCNT2 = 0;            // Reset Timer2 count
-      timer_2_overflow_count = 0;  // Reset overflow count
-      TCCR2B |= (1 << CS21); // Start Timer2 with prescaler 8
-      echo_complete = true; // Start measuring
+    echo_start = now; // Start measuring
+    echo_started = true;
   } 
-  else  // Falling edge
+  else if(echo_started)  // Falling edge
   {
-      TCCR2B = 0; // Stop Timer2 (clear prescaler bits)
-      // f_clk = 2000000Hz = 2000000 ticks/sec
-      // distance in us = 1/2000000 sec/tick * x ticks * 10^-6 = 1/2 us/tick * x ticks
-
-      echo_duration = TCNT2 + (timer_2_overflow_count << 8); // TCNT2 + overflow count * 256
-      echo_duration = echo_duration >> 1; // (TCNT2 + overflow count * 256) / 2
+    // Timer2 is the free-running timebase (4us resolution), so just subtract timestamps
+    uint32_t echo_us = now - echo_start;
 
-      echo_complete = false; // Reset for next measurement
+    if(echo_us > US_MAX_ECHO_US)
+      US_complete(US_NO_ECHO, 0, now);
+    else
+      US_complete(US_READY, echo_us, now);
   }
-}
 
-ISR(TIMER2_OVF_vect)
-{
-  timer_2_overflow_count++;  // Increment overflow counter every time the timer overflows
+  PROFILE_END(int0);
 }
 
 void US_init()
 {
   DDRB |= (1 << TRIG_PIN); // Set trig pin as output
 
-  // Set Timer/Counter2 for normal mode
-  TCCR2A = 0;            // Normal mode
-  TCCR2B = 0;            // Stop Timer2
-  TCNT2 = 0;             // Reset Timer2
-  TIMSK2 = (1 << TOIE2);  // Enable Timer2 overflow interrupt
-  
+  // Echo timing uses the timebase (Timer2), which must already be running
   init_ext_interrupt(); // Initialise external interrupts on echo pin
 
   sei();  // Enable global interrupts
@@ -53,17 +73,70 @@ void init_ext_interrupt()
   EIMSK |= (1 << INT0);   // Enable INT0  
 }
 
-uint16_t read_distance_US()
+uint8_t US_start()
 {
+  if(US_poll() == US_BUSY)
+    return 1;
+
+  uint8_t sreg = SREG;
+  cli();
+  echo_started = false;
+  trigger_time = micros();
+  us_state = US_BUSY;
+  SREG = sreg;
+
   trigger_US_sensor();
-  _delay_ms(20);  // Wait for measurement to complete
-  uint16_t distance = echo_duration / 58;
 
-  uart_txString("Distance is: ");
-  uart_txU16(distance);
-  uart_txString("cm\n");
+  return 0;
+}
+
+uint8_t US_poll()
+{
+  uint8_t state;
+  uint8_t sreg = SREG;
 
-  return distance;
+  cli();
+  if(us_state == US_BUSY && micros() - trigger_time > US_TIMEOUT_US) {
+    // An echo that started but never ended means nothing was in range; no echo at all is a fault
+    US_complete(echo_started ? US_NO_ECHO : US_TIMEOUT, 0, micros());
+  }
+  state = us_state;
+  SREG = sreg;
+
+  return state;
+}
+
+uint8_t US_get_result(us_result_t *r)
+{
+  bool is_new;
+  uint8_t sreg = SREG;
+
+  cli();
+  r->status = us_result.status;
+  r->echo_us = us_result.echo_us;
+  r->timestamp = us_result.timestamp;
+  r->seq = us_result.seq;
+  is_new = us_result_new;
+  us_result_new = false;
+  SREG = sreg;
+
+  r->distance_cm = (r->status == US_READY) ? us_echo_to_cm(r->echo_us) : 0;
+
+  return is_new;
+}
+
+uint16_t read_distance_US()
+{
+  us_result_t r;
+
+  US_start();
+  while(US_poll() == US_BUSY);  // Wait for measurement to complete
+  US_get_result(&r);
+
+  if(r.status == US_NO_ECHO)
+    return US_NO_ECHO_DISTANCE;
+
+  return r.distance_cm;
 }
 
 void trigger_US_sensor()
@@ -71,4 +144,4 @@ void trigger_US_sensor()
   PORTB |= (1 << TRIG_PIN);   // Set trigger pin high
   _delay_us(10);              // Wait for 10 microseconds
   PORTB &= ~(1 << TRIG_PIN);  // Set trigger pin low
-}
\ No newline at end of file
+}
@@ -11,12 +11,37 @@
 #include <avr/interrupt.h>
 #include <stdbool.h>
 
+#define US_MAX_ECHO_US 25000      // ~430cm. The sensor holds echo high for ~38ms when nothing is in range
+#define US_TIMEOUT_US 40000       // Give up on a measurement this long after the trigger
+#define US_NO_ECHO_DISTANCE 500   // Distance reported by read_distance_US() when nothing is in range
+
+// Measurement states
+#define US_IDLE 0                 // Nothing in progress
+#define US_BUSY 1                 // Triggered, waiting for the echo
+#define US_READY 2                // Result is a valid distance
+#define US_NO_ECHO 3              // Echo too long or never finished: nothing in range
+#define US_TIMEOUT 4              // Echo never started: sensor didn't respond
+
+typedef struct {
+  uint16_t distance_cm;
+  uint16_t echo_us;
+  uint32_t timestamp;             // micros() when the measurement finished
+  uint8_t seq;                    // Incremented for every finished measurement
+  uint8_t status;                 // US_READY, US_NO_ECHO or US_TIMEOUT
+} us_result_t;
+
 void US_init();
 
 void init_ext_interrupt();
 
-uint16_t read_distance_US();
+uint8_t US_start();                     // Trigger a measurement. Returns 1 (and does nothing) if one is already running
+
+uint8_t US_poll();                      // US_BUSY while measuring, otherwise US_IDLE. Also handles timeouts
+
+uint8_t US_get_result(us_result_t *r);  // Copy the latest finished measurement. Returns 1 if it hasn't been read before
+
+uint16_t read_distance_US();            // Blocking: measure and return the distance (US_NO_ECHO_DISTANCE if nothing, 0 on timeout)
 
 void trigger_US_sensor();
 
-#endif
\ No newline at end of file
+#endif
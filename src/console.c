@@ -0,0 +1,175 @@
+#include "console.h"
+#include "params.h"
+#include "profiler.h"
+#include <string.h>
+#include <avr/pgmspace.h>
+
+static char line[CONSOLE_LINE_LENGTH];
+static uint8_t length = 0;
+static uint8_t overlong = 0;                // The current line didn't fit, so it's thrown away
+
+static uint8_t (*dump_line)(uint8_t index) = 0;
+static uint8_t dump_index;
+
+static uint8_t saving = 0;                  // "save" is writing EEPROM, a byte a poll
+
+static const console_command_t *help_commands;
+static uint8_t help_count;
+
+char *console_next_word(char *s)
+{
+  while(*s != '\0' && *s != ' ')
+    s++;
+  while(*s == ' ')
+    *s++ = '\0';
+  return s;
+}
+
+uint8_t console_parse(const char *s, int32_t *value)
+{
+  uint8_t negative = (*s == '-');
+  int32_t v = 0;
+
+  if(negative)
+    s++;
+  if(*s == '\0')
+    return 1;
+
+  for(; *s != '\0'; s++) {
+    if(*s < '0' || *s > '9' || v > 100000)
+      return 1;
+    v = (v << 3) + (v << 1) + (*s - '0');
+  }
+
+  *value = negative ? -v : v;
+  return 0;
+}
+
+void console_dump(uint8_t (*line)(uint8_t index))
+{
+  dump_line = line;
+  dump_index = 0;
+}
+
+static uint8_t help_line(uint8_t index)
+{
+  if(index == 0) {
+    uart_txFormatted_P(PSTR("list, get <name>, set <name> <value>, save, defaults\n"));
+    return 1;
+  }
+
+#if PROFILER_ENABLE
+  if(index == 1) {
+    uart_txFormatted_P(PSTR("profile [reset|ab]\n"));
+    return 1;
+  }
+  index--;
+#endif
+
+  if(index - 1 >= help_count)
+    return 0;
+
+  uart_txFormatted_P(PSTR("%S\n"), help_commands[index - 1].usage);
+  return 1;
+}
+
+// Returns 1 if a parameter changed
+static uint8_t run_command(char *name, const console_command_t *commands, uint8_t count)
+{
+  char *args = console_next_word(name);
+
+  if(*name == '\0')
+    return 0;
+
+  if(strcmp_P(name, PSTR("list")) == 0) {
+    console_dump(params_print);
+  }
+  else if(strcmp_P(name, PSTR("save")) == 0) {
+    params_save();
+    saving = 1;
+  }
+  else if(strcmp_P(name, PSTR("defaults")) == 0) {
+    params_load_defaults();
+    uart_txString("defaults loaded\n");
+    return 1;
+  }
+  else if(strcmp_P(name, PSTR("get")) == 0 || strcmp_P(name, PSTR("set")) == 0) {
+    char *value = console_next_word(args);
+    int8_t index = params_find(args);
+    int32_t v;
+
+    if(index < 0) {
+      uart_txString("no such parameter\n");
+    }
+    else if(name[0] == 'g') {
+      params_print(index);
+    }
+    else if(console_parse(value, &v) || params_set(index, v)) {
+      uart_txString("out of range\n");
+    }
+    else {
+      params_print(index);
+      return 1;
+    }
+  }
+#if PROFILER_ENABLE
+  else if(strcmp_P(name, PSTR("profile")) == 0) {
+    if(strcmp_P(args, PSTR("reset")) == 0)
+      profile_reset();
+    else if(strcmp_P(args, PSTR("ab")) == 0)
+      console_dump(profile_ab);
+    else
+      console_dump(profile_print);
+  }
+#endif
+  else {
+    for(uint8_t i = 0; i < count; i++) {
+      if(strcmp(name, commands[i].name) == 0) {
+        commands[i].run(args);
+        return 0;
+      }
+    }
+
+    console_dump(help_line);
+  }
+
+  return 0;
+}
+
+uint8_t console_poll(const console_command_t *commands, uint8_t count)
+{
+  uint8_t changed = 0;
+
+  help_commands = commands;
+  help_count = count;
+
+  if(saving && !params_save_step()) {
+    saving = 0;
+    uart_txString("saved\n");
+  }
+
+  if(dump_line && uart_txFree() >= CONSOLE_DUMP_LINE) {
+    if(!dump_line(dump_index++))
+      dump_line = 0;
+  }
+
+  for(uint8_t n = 0; n < CONSOLE_MAX_CHARS && uart_rxReady(); n++) {
+    char c = uart_rxChar();
+
+    if(c == '\r' || c == '\n') {
+      line[length] = '\0';
+      if(!overlong)
+        changed = run_command(line, commands, count);
+      length = 0;
+      overlong = 0;
+      break;  // One command per poll
+    }
+
+    if(length < CONSOLE_LINE_LENGTH - 1)
+      line[length++] = c;
+    else
+      overlong = 1;
+  }
+
+  return changed;
+}
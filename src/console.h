@@ -0,0 +1,48 @@
+#ifndef console_h
+#define console_h
+
+#include <inttypes.h>
+#include "UART.h"
+
+/*
+  Command console on the UART. console_poll() is called from a scheduler task. Each call takes at most
+  CONSOLE_MAX_CHARS characters from the receive buffer and runs at most one command, so it never holds up
+  the control loop for long.
+
+  Commands are a name and space separated arguments, ending with a newline. Built in:
+    list                  every parameter and its value (params.h)
+    get <name>
+    set <name> <value>    in range, or it's refused
+    save                  write the current parameters to EEPROM, a byte per poll, then print "saved"
+    defaults              go back to the flash defaults (not saved until "save")
+    profile [reset|ab]    print (or clear) the stage timings, or run the A/B timings, when built with
+                          PROFILER_ENABLE (profiler.h)
+    help
+  The rest come from the table passed to console_poll().
+
+  Nothing that prints more than a line waits for the UART. It hands console_dump() a function that
+  prints one line at a time. Each poll prints the next line, once the transmit buffer has room for a
+  whole line, until the function returns 0.
+*/
+
+#define CONSOLE_LINE_LENGTH 32            // Longest command, including arguments
+#define CONSOLE_MAX_CHARS 8               // Per poll. At 9600 baud about one arrives per ms
+#define CONSOLE_DUMP_LINE (UART_TX_BUFFER_SIZE - 1)  // Longest line a dump function may print
+
+typedef struct {
+  const char *name;
+  void (*run)(char *args);    // args is the rest of the line, "" if there's nothing
+  const char *usage;          // In flash, for help
+} console_command_t;
+
+#define COMMAND(name, fn, usage) {name, fn, usage}
+
+uint8_t console_poll(const console_command_t *commands, uint8_t count);  // Returns 1 if a parameter changed
+
+void console_dump(uint8_t (*line)(uint8_t index));  // Print line(0), line(1), ... over the next polls. Replaces any dump in progress
+
+char *console_next_word(char *s);                   // Ends the word s starts with, returns the one after it ("" at the end)
+
+uint8_t console_parse(const char *s, int32_t *value);  // Decimal with an optional '-'. Returns 1 if s is anything else
+
+#endif
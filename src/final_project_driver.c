@@ -2,9 +2,24 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
 #include "IMU.h"
 #include "US_sensor.h"
+#include "IR_sensor.h"
 #include "timer1_servo.h"
+#include "timebase.h"
+#include "scheduler.h"
+#include "UART.h"
+#include "telemetry.h"
+#include "scan.h"
+#include "gap_select.h"
+#include "heading.h"
+#include "params.h"
+#include "console.h"
+#include "convert.h"
+#include "profiler.h"
+#include "recorder.h"
 
 /* 
   Author: Ella Noyes
@@ -16,14 +31,18 @@
       - PC4 as SDA (serial data pin)
       - These are on Port 7 on ENCS board (which are connected to a semiconductor voltage regulator,
         so the default TWI Vcc is 3.3V)
+      - PD3 (INT1) for the MPU's data-ready interrupt
     - Servo uses:
       - PB1 as output
       - Timer/Counter1 configurations (with prescaler 64)
     - US sensor uses:
       - Port 6 on ENCS board for Vcc, Trig, Echo, and GND
-      - Time/Counter2 (with prescaler 8) for measuring echo time
+      - micros() from the timebase for measuring echo time
+    - Timebase uses:
+      - Timer/Counter2 (with prescaler 64), free running, for micros()/millis()
     - IR sensor uses 
       - Port 5 on ENCS board (PC0: ADC0)
+      - The ADC, free running with its interrupt
     - Lift fan uses
       - PD5
       - Timer/Counter0 with OCR0B
@@ -33,265 +52,535 @@
 */
 
 #define GYRO_RANGE 250        // Gyro range will be set to ±GYRO_RANGE
-#define YAW_COMPENSATION -80  // Compensates for overturning on smooth surfaces
+#define IMU_USE_FIFO 1        // Integrate every sample from the MPU's FIFO instead of one reading per loop
+#define IMU_SAMPLE_RATE_DIV 9 // FIFO sample rate is 1kHz / (1 + 9) = 100Hz
+#define IMU_USE_FUSION 1      // Correct roll/pitch and the gyro bias with the accelerometer (FIFO mode only)
 
-#define IR_READING_MIN 45
-#define IR_READING_MAX 70
+// Fan speeds, obstacle distances, IR window and heading gains are runtime parameters (params.h)
 
-#define US_READING_MIN 30
 #define US_CLEAR_AHEAD 37
-#define US_SLOWDOWN_DISTANCE 85
-
-#define THRUST_FAN_MEDIUM 175
-#define THRUST_FAN_SLOW 50
-
-#define LIFT_FAN_SPEED 235
-#define LIFT_FAN_SLOW 225
-
-int servo_sweep_angles[2][7] = {{90, 60, 30, 0, -30, -60, -90}, 
-                                {85, 119, 153, 188, 223, 257, 290}};
-
-uint16_t servo_pulses[181] = {
-85, 86, 87, 88, 89, 90, 91, 92, 94, 
-95, 96, 97, 98, 99, 100, 102, 103, 104, 105, 
-106, 107, 108, 110, 111, 112, 113, 114, 115, 116, 
-118, 119, 120, 121, 122, 123, 124, 126, 127, 128, 
-129, 130, 131, 132, 133, 135, 136, 137, 138, 139, 
-140, 141, 143, 144, 145, 146, 147, 148, 149, 151, 
-152, 153, 154, 155, 156, 157, 159, 160, 161, 162, 
-163, 164, 165, 167, 168, 169, 170, 171, 172, 173, 
-174, 176, 177, 178, 179, 180, 181, 182, 184, 185, 
-186, 187, 188, 189, 190, 192, 193, 194, 195, 196, 
-197, 198, 200, 201, 202, 203, 204, 205, 206, 208, 
-209, 210, 211, 212, 213, 214, 215, 217, 218, 219, 
-220, 221, 222, 223, 225, 226, 227, 228, 229, 230, 
-231, 233, 234, 235, 236, 237, 238, 239, 241, 242, 
-243, 244, 245, 246, 247, 249, 250, 251, 252, 253, 
-254, 255, 256, 258, 259, 260, 261, 262, 263, 264, 
-266, 267, 268, 269, 270, 271, 272, 274, 275, 276, 
-277, 278, 279, 280, 282, 283, 284, 285, 286, 287, 
-288, 290 
-};
 
-#define SERVO_PULSE_VALUES 1  // Index of pulse values in sweep angles array
-#define ANGLE_VALUES 0        // Index of angle values in sweep angles array
-#define LOOK_TIME 1000         // Look time is 800ms
+#define HULL_WIDTH 30 // cm, skirt plus a bit of margin
+#define GAP_MIN_BINS GAP_BINS_FOR_WIDTH(HULL_WIDTH, US_CLEAR_AHEAD)
+
+// Task periods in ms
+#define IMU_PERIOD 5          // 200Hz
+#define STEERING_PERIOD 20    // 50Hz
+#define RANGING_PERIOD 66     // 15Hz
+#define IR_PERIOD 50          // 20Hz
+#define TELEMETRY_PERIOD 100  // 10Hz
+#define CONSOLE_PERIOD 5      // Up to CONSOLE_MAX_CHARS a time, faster than they arrive at 9600
+#define SCAN_PERIOD 5         // Only does anything during an obstacle scan. Well inside SCAN_PING_GAP_MS
+#define RECORDER_PERIOD RECORDER_PERIOD_MS  // 20Hz
+
+#define RECORDER_BUMP 768     // Horizontal acceleration that counts as hitting something, 0.75g in recorded units
+
+#define TELEMETRY_BINARY 1    // Send framed binary packets (decode with tools/telemetry_decode) instead of text
+
+
 #define SERVO_STRAIGHT 188
-#define SERVO_RIGHT 290
-#define SERVO_LEFT 85
 
-volatile float gyro_x, gyro_y, gyro_z; // variables for gyro raw data
-volatile float roll = 0, pitch = 0, yaw = 0;
+// Servo motion limits for the Timer1 motion engine
+#define SERVO_STEER_RATE SERVO_RATE(500)      // Ticks per second
+#define SERVO_STEER_ACCEL SERVO_ACCEL(5000)   // Ticks per second squared
+
+angle_q16_t roll = 0, pitch = 0, yaw = 0;  // Degrees in Q16.16 fixed point
+
+uint16_t wall_distance = US_NO_ECHO_DISTANCE;  // Latest ultrasonic range in cm
+scan_t gap_scan;                               // Range profile from the last obstacle scan
+uint32_t turn_start;                           // millis() when the last avoidance turn started
 
 volatile bool obstacle_detected = false;
+volatile bool avoiding_obstacle = false;
+bool scanning = false;                         // avoid_obstacle() has started a scan that scan_task() hasn't finished
 volatile bool end_of_course = false;
 
+// Console overrides
+bool running = true;          // "stop" puts the craft down until "start"
+bool fans_manual = false;     // "fan": fan speeds set from the console, not by ranging
+bool servo_manual = false;    // "servo": servo held where the console put it, not steered
+int8_t servo_manual_heading = 0;
+bool telemetry_on = true;
+
 // Some function prototypes
 void init_driver();
-void init_IR_sensor();
-void read_vertical_IR();
-uint16_t find_gaps();
-void set_servo_to_yaw(float yaw);
-float get_yaw_from_ticks(uint16_t ticks);
+uint8_t find_gaps(int8_t *heading);
 void fans_init();
 void set_lift_fan_speed(uint8_t dutyCycle);
 void set_thrust_fan_speed(uint8_t dutyCycle);
 void reset_angles();
-void straighten_servo(uint16_t current_pulse);
+void avoid_obstacle();
+void update_attitude();
+void print_angles();
+void log_step_response();
+
+
+// Scheduled tasks
+void imu_task();
+void steering_task();
+void ranging_task();
+void ir_task();
+void telemetry_task();
+void console_task();
+void recorder_task();
+void scan_task();
+
+// Console commands
+void start_command(char *args);
+void stop_command(char *args);
+void fan_command(char *args);
+void servo_command(char *args);
+void rate_command(char *args);
+void stats_command(char *args);
+void rec_command(char *args);
+
+static const char start_usage[] PROGMEM = "start";
+static const char stop_usage[] PROGMEM = "stop                  fans off, until start";
+static const char fan_usage[] PROGMEM = "fan <lift> <thrust> | fan auto";
+static const char servo_usage[] PROGMEM = "servo <-90..90> | servo auto";
+static const char rate_usage[] PROGMEM = "rate <ms>             telemetry period, 0 for off";
+static const char stats_usage[] PROGMEM = "stats";
+static const char rec_usage[] PROGMEM = "rec [trigger|dump|clear]  flight recorder";
+
+const console_command_t commands[] = {
+  COMMAND("start", start_command, start_usage),
+  COMMAND("stop", stop_command, stop_usage),
+  COMMAND("fan", fan_command, fan_usage),
+  COMMAND("servo", servo_command, servo_usage),
+  COMMAND("rate", rate_command, rate_usage),
+  COMMAND("stats", stats_command, stats_usage),
+  COMMAND("rec", rec_command, rec_usage),
+};
 
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+task_t tasks[] = {
+  TASK("imu", imu_task, IMU_PERIOD),
+  TASK("steering", steering_task, STEERING_PERIOD),
+  TASK("ranging", ranging_task, RANGING_PERIOD),
+  TASK("ir", ir_task, IR_PERIOD),
+  TASK("telemetry", telemetry_task, TELEMETRY_PERIOD),
+  TASK("console", console_task, CONSOLE_PERIOD),
+  TASK("recorder", recorder_task, RECORDER_PERIOD),
+  TASK("scan", scan_task, SCAN_PERIOD),
+};
+
+#define NUM_TASKS (sizeof(tasks) / sizeof(tasks[0]))
 
 int main()
 {
   init_driver();
-  
-  uint16_t counter = 50;
-  uint16_t wall_distance, turn_pulse;
-  float target_yaw, compensated_target_yaw;
+
+  scheduler_init(tasks, NUM_TASKS);
 
   while(!end_of_course)
   {
-    update_gyro_angles(0.02, &roll, &pitch, &yaw);
-
-    print_angles();
-
-    _delay_ms(20);
-    set_servo_to_yaw(yaw);
-
-    //read_vertical_IR(); // Check for bar
-
-    //wall_distance = read_distance_US(); // Includes 20ms delay
-    // if(wall_distance < US_SLOWDOWN_DISTANCE)
-    // {
-    //   set_thrust_fan_speed(THRUST_FAN_SLOW);
-    //   set_lift_fan_speed(LIFT_FAN_SLOW);
-    // }
-    // else
-    // {
-    //   set_thrust_fan_speed(THRUST_FAN_MEDIUM);
-    //   set_lift_fan_speed(LIFT_FAN_SPEED);
-    // }
-
-    // if(wall_distance < US_READING_MIN)
-    // {
-    //   set_thrust_fan_speed(0);  // Stop thrust fan
-    //   set_lift_fan_speed(0);    // Stop lift fan
-
-    //   turn_pulse = find_gaps();
-    //   target_yaw = get_yaw_from_ticks(turn_pulse);
-
-      
-    //   set_thrust_fan_speed(THRUST_FAN_SLOW);  // Start thrust fan
-    //   set_lift_fan_speed(LIFT_FAN_SPEED);     // Start lift fan 
-
-    //   set_servo_pulse(turn_pulse);
-
-    //   reset_angles();
- 
-    //   if(target_yaw < 0)
-    //     compensated_target_yaw = target_yaw - YAW_COMPENSATION;
-    //   else if(target_yaw > 0)
-    //     compensated_target_yaw = target_yaw + YAW_COMPENSATION;
-              
-    //   while(fabs(yaw) < fabs(compensated_target_yaw))
-    //   {
-    //     _delay_ms(10);
-    //     update_gyro_angles(0.01, &roll, &pitch, &yaw);
-    //   } // Let it turn
-
-    //   reset_angles();
-    //   straighten_servo(turn_pulse);
-    
-    //   set_lift_fan_speed(LIFT_FAN_SPEED); // Restart lift fan
-    // }
+    scheduler_run_once(tasks, NUM_TASKS);
+
+    if(obstacle_detected)
+    {
+      avoid_obstacle();
+      obstacle_detected = false;
+    }
   }
 
   set_lift_fan_speed(0);
   set_thrust_fan_speed(0);
+  recorder_freeze(RECORDER_TRIGGER_END);
 
-  return 0;
-}
+  imu_calibration_save(GYRO_RANGE); // Keep anything learned while sitting still during the run
 
-void init_driver()
-{
-  US_init();
-  init_IR_sensor();
-  servo_setup(0);
-  imu_init(GYRO_RANGE);
-  calibrate_imu();
+  uart_txMode(UART_TX_BLOCK); // Don't lose any of the stats or the recording
 
-  uart_init_9600();
+  uart_txChar(0);             // Whatever was sent last ends here, so the first chunk is a frame of its own
+  for(uint8_t i = 0; recorder_dump_packet(i); i++);
 
-  _delay_ms(1000);
+  scheduler_print_stats(tasks, NUM_TASKS);
+  uart_txFlush();
 
-  fans_init();
+  return 0;
+}
 
-  _delay_ms(1000);
+void update_attitude()
+{
+#if IMU_USE_FIFO && IMU_USE_FUSION
+  update_fused_angles_fifo(&roll, &pitch, &yaw);
+#elif IMU_USE_FIFO
+  update_gyro_angles_fifo(&roll, &pitch, &yaw);
+#else
+  update_gyro_angles_fx(&roll, &pitch, &yaw);
+#endif
+}
 
-  sei();
+void imu_task()
+{
+  update_attitude();
 }
 
-void init_IR_sensor()
+// Ranging and obstacle avoidance only drive the fans while nothing on the console has taken them over
+bool fans_automatic()
 {
-  ADMUX |= (1 << REFS0);  // Use AVCC with external capacitor at AREF pin
-  ADCSRA |= (1 << ADPS2) | (1 << ADPS1);  // Set prescaler to 64
-  ADMUX |= (1 << ADLAR); // Set result as left-adjusted
-  ADCSRA |= (1 << ADEN);  // Enable ADC
+  return running && !fans_manual;
 }
 
-// Read distance using an IR sensor connected to ADC0
-void read_vertical_IR()
+void steering_task()
 {
-  ADMUX = (ADMUX & 0xF8); // Select ADC0 as input channel 
-  ADCSRA |= (1 << ADSC);  // Start the conversion
-  while (ADCSRA & (1 << ADSC)); // Wait while ADC conversion is taking place
+  if(scanning)
+    return; // The scan has the servo
+
+  PROFILE_BEGIN(steering);
+
+  angle_q16_t servo_heading = heading_update(yaw, yaw_rate_to_angle(STEERING_PERIOD * 1000U));
 
-  uint8_t reading = ADCH;
+  if(servo_manual)
+    servo_heading = ANGLE_Q16(servo_manual_heading);
 
-  if(reading > IR_READING_MIN && reading < IR_READING_MAX)
+  servo_move_to(servo_heading_q16_to_pulse(servo_heading), SERVO_STEER_RATE, SERVO_STEER_ACCEL);
+
+  if(avoiding_obstacle && (heading_settled() || millis() - turn_start > params.heading_turn_timeout_ms))
   {
-    end_of_course = true;
+    if(!heading_settled())
+      recorder_trigger(RECORDER_TRIGGER_TIMEOUT);
+    if(fans_automatic())
+      set_lift_fan_speed(params.lift_fan_speed); // Restart lift fan
+    avoiding_obstacle = false;
+    log_step_response();
   }
+
+  PROFILE_END(steering);
 }
 
-uint16_t find_gaps()
+// Picks up the last finished measurement (if there is one) and starts the next, so ranging never
+// waits on the sensor
+void ranging_task()
 {
-  uint16_t servo_pulse;
-  uint16_t distance_ahead;
-  
-  // ***********************************
-  // LOOK RIGHT
-  // ***********************************
-  set_servo_pulse(SERVO_RIGHT);
-  _delay_ms(LOOK_TIME); // Make sure the servo's steady
-  distance_ahead = read_distance_US();
-  if(distance_ahead > US_CLEAR_AHEAD)
+  if(scanning)
+    return; // The scan has the sensor
+
+  PROFILE_BEGIN(ranging);
+
+  us_result_t result;
+  uint8_t have_result = US_get_result(&result);
+
+  US_start();
+
+  if(!have_result || result.status == US_TIMEOUT || avoiding_obstacle || !fans_automatic())
+  {
+    // Nothing new, the sensor didn't answer, we're turning and the fans are left alone until it's done,
+    // or the console has the fans
+    PROFILE_END(ranging);
+    return;
+  }
+
+  wall_distance = (result.status == US_READY) ? result.distance_cm : US_NO_ECHO_DISTANCE;
+
+  if(wall_distance < params.us_slowdown_distance)
   {
-    servo_pulse = SERVO_RIGHT;
+    set_thrust_fan_speed(params.thrust_fan_slow);
+    set_lift_fan_speed(params.lift_fan_slow);
   }
   else
   {
-    // ***********************************
-    // LOOK LEFT
-    // ***********************************
-    set_servo_pulse(SERVO_LEFT);
-    _delay_ms(LOOK_TIME); // Make sure the servo's steady
-    distance_ahead = read_distance_US();
-    if(distance_ahead > US_CLEAR_AHEAD)
-    {
-      servo_pulse = SERVO_LEFT;
-    }
-    else
-    {
-      // ***********************************
-      // SWEEP
-      // *********************************** 
-      uint16_t max_distance_pulse = 0, max_distance_ahead = 0; 
-      for(int i = 0; i < 7; i++)
-      {
-        set_servo_pulse(servo_sweep_angles[SERVO_PULSE_VALUES][i]);
-        _delay_ms(LOOK_TIME); // Make sure the servo's steady
-        distance_ahead = read_distance_US();
-
-        if(distance_ahead > max_distance_ahead)
-        {
-          max_distance_ahead = distance_ahead;
-          max_distance_pulse = servo_sweep_angles[SERVO_PULSE_VALUES][i];
-        }
-      }
-      servo_pulse = max_distance_pulse;
-    }
-    
+    set_thrust_fan_speed(params.thrust_fan_medium);
+    set_lift_fan_speed(params.lift_fan_speed);
+  }
+
+  if(wall_distance < params.us_reading_min)
+    obstacle_detected = true;
+
+  PROFILE_END(ranging);
+}
+
+// The ADC interrupt does the sampling; this only looks at what it collected (IR_sensor.h)
+void ir_task()
+{
+  PROFILE_BEGIN(ir);
+
+  if(IR_bar_update(IR_READING(params.ir_reading_min), IR_READING(params.ir_reading_max)))
+    end_of_course = true;
+
+  PROFILE_END(ir);
+}
+
+void telemetry_task()
+{
+  if(!telemetry_on)
+    return;
+
+  PROFILE_BEGIN(telemetry);
+
+#if TELEMETRY_BINARY
+  telemetry_state_t state;
+
+  state.accel_x = accel_x;
+  state.accel_y = accel_y;
+  state.accel_z = accel_z;
+  state.gyro_x = gyro_x;
+  state.gyro_y = gyro_y;
+  state.gyro_z = gyro_z;
+  state.roll = roll;
+  state.pitch = pitch;
+  state.yaw = yaw;
+  state.range_cm = wall_distance;
+  state.servo_pulse = servo_position();
+  state.thrust_fan = OCR0A;
+  state.lift_fan = OCR0B;
+  state.flags = (obstacle_detected ? TELEMETRY_FLAG_OBSTACLE : 0) |
+                (avoiding_obstacle ? TELEMETRY_FLAG_AVOIDING : 0) |
+                (end_of_course ? TELEMETRY_FLAG_END : 0);
+
+  telemetry_send(TELEMETRY_STATE, &state, sizeof(state));
+#else
+  print_angles();
+#endif
+
+  PROFILE_END(telemetry);
+}
+
+// A frame for the flight recorder (recorder.h), and a trigger if the accelerometer says we hit something
+void recorder_task()
+{
+  recorder_frame_t frame;
+
+  frame.time_ms = (int16_t)millis();
+  frame.yaw = yaw >> 10;
+  frame.roll = roll >> 10;
+  frame.pitch = pitch >> 10;
+  frame.gyro_z = gyro_z >> 2;
+  frame.accel_x = accel_x >> 4;
+  frame.accel_y = accel_y >> 4;
+  frame.range_cm = wall_distance;
+  frame.servo_pulse = servo_position();
+  frame.thrust_fan = OCR0A;
+  frame.lift_fan = OCR0B;
+  frame.flags = (obstacle_detected ? TELEMETRY_FLAG_OBSTACLE : 0) |
+                (avoiding_obstacle ? TELEMETRY_FLAG_AVOIDING : 0) |
+                (end_of_course ? TELEMETRY_FLAG_END : 0);
+
+  recorder_add(&frame);
+
+  if(frame.accel_x > RECORDER_BUMP || frame.accel_x < -RECORDER_BUMP ||
+     frame.accel_y > RECORDER_BUMP || frame.accel_y < -RECORDER_BUMP)
+    recorder_trigger(RECORDER_TRIGGER_BUMP);
+}
+
+// Commands from the UART (console.h)
+void console_task()
+{
+  PROFILE_BEGIN(console);
+
+  if(console_poll(commands, NUM_COMMANDS))
+    heading_tune(params.heading_kp, params.heading_ki, params.heading_kd);
+
+  PROFILE_END(console);
+}
+
+void start_command(char *args)
+{
+  (void)args;
+
+  running = true;
+  fans_manual = false;
+  set_thrust_fan_speed(params.thrust_fan_medium);
+  set_lift_fan_speed(params.lift_fan_speed);
+  uart_txString("started\n");
+}
+
+void stop_command(char *args)
+{
+  (void)args;
+
+  running = false;
+  fans_manual = false;
+  set_thrust_fan_speed(0);
+  set_lift_fan_speed(0);
+  uart_txString("stopped\n");
+}
+
+// fan <lift> <thrust>, or fan auto to hand them back
+void fan_command(char *args)
+{
+  char *thrust = console_next_word(args);
+  int32_t lift_speed, thrust_speed;
+
+  if(strcmp_P(args, PSTR("auto")) == 0) {
+    fans_manual = false;
+    uart_txString("fans auto\n");
+    return;
+  }
+
+  if(console_parse(args, &lift_speed) || console_parse(thrust, &thrust_speed) ||
+     lift_speed < 0 || lift_speed > 255 || thrust_speed < 0 || thrust_speed > 255) {
+    uart_txString("fan <lift> <thrust> (0-255) | fan auto\n");
+    return;
+  }
+
+  fans_manual = true;
+  set_lift_fan_speed(lift_speed);
+  set_thrust_fan_speed(thrust_speed);
+  uart_txFormatted_P(PSTR("fans %u %u\n"), (uint8_t)lift_speed, (uint8_t)thrust_speed);
+}
+
+// servo <heading>, or servo auto to give it back to the heading controller
+void servo_command(char *args)
+{
+  int32_t heading;
+
+  if(strcmp_P(args, PSTR("auto")) == 0) {
+    servo_manual = false;
+    uart_txString("servo auto\n");
+    return;
   }
 
-  set_servo_pulse(188); // Straighten
-  _delay_ms(LOOK_TIME); // Make sure the servo's steady
+  if(console_parse(args, &heading) || heading < -90 || heading > 90) {
+    uart_txString("servo <-90..90> | servo auto\n");
+    return;
+  }
 
-  return servo_pulse;
+  servo_manual_heading = heading;
+  servo_manual = true;
+  uart_txFormatted_P(PSTR("servo %d\n"), servo_manual_heading);
 }
 
-void set_servo_to_yaw(float yaw) 
+void rate_command(char *args)
 {
-  int int_yaw = (int)yaw;
-  if(int_yaw > -91 && int_yaw < 91)
+  int32_t period;
+
+  if(console_parse(args, &period) || period < 0 || period > 10000 || (period > 0 && period < 20)) {
+    uart_txString("rate <ms> (20-10000, 0 for off)\n");
+    return;
+  }
+
+  telemetry_on = (period != 0);
+  for(uint8_t i = 0; i < NUM_TASKS; i++)
   {
-    set_servo_pulse(servo_pulses[int_yaw + 90]);
+    if(tasks[i].run == telemetry_task && period)
+      tasks[i].period_ms = period;
+  }
+
+  uart_txFormatted_P(PSTR("telemetry %u ms\n"), (uint16_t)period);
+}
+
+// One line per task, then the UART and sensor counters
+uint8_t stats_line(uint8_t index)
+{
+  if(index < NUM_TASKS)
+    scheduler_print_task(&tasks[index]);
+  else if(index == NUM_TASKS)
+    uart_txFormatted_P(PSTR("uart: tx dropped %u, rx lost %u, telemetry dropped %u\n"),
+                       uart_tx_dropped, uart_rx_lost, telemetry_dropped);
+  else if(index == NUM_TASKS + 1)
+    uart_txFormatted_P(PSTR("imu fifo overflows %u, ir overruns %u\n"), imu_fifo_overflows, ir_overruns);
+  else
+    return 0;
+
+  return 1;
+}
+
+void stats_command(char *args)
+{
+  (void)args;
+
+  console_dump(stats_line);
+}
+
+// No argument: what the recorder is doing. "dump" freezes it first, if nothing else has
+void rec_command(char *args)
+{
+  if(strcmp_P(args, PSTR("trigger")) == 0) {
+    recorder_trigger(RECORDER_TRIGGER_COMMAND);
+  }
+  else if(strcmp_P(args, PSTR("dump")) == 0) {
+    recorder_freeze(RECORDER_TRIGGER_COMMAND);
+    uart_txChar(0);  // End any text before it, so the first chunk is a frame of its own
+    console_dump(recorder_dump_packet);
+    return;
+  }
+  else if(strcmp_P(args, PSTR("clear")) == 0) {
+    recorder_clear();
+  }
+
+  uart_txFormatted_P(PSTR("recorder: reason %u, %S\n"), recorder_state(),
+                     recorder_frozen() ? PSTR("frozen") : PSTR("recording"));
+}
+
+// Stop and start scanning for a gap. scan_task() points the heading controller at what it finds and
+// steering_task() finishes the turn, so nothing here waits for the sweep
+void avoid_obstacle()
+{
+  avoiding_obstacle = true;
+
+  set_thrust_fan_speed(0);  // Stop thrust fan
+  set_lift_fan_speed(0);    // Stop lift fan
+
+  scan_start(&gap_scan);
+  scanning = true;
+}
+
+// Moves the obstacle scan along (the sweep pings whenever this finds the sensor free), and starts
+// the turn once the sweep is over, or sweeps again if it came back with nothing usable
+void scan_task()
+{
+  int8_t gap_heading;
+
+  if(!scanning || !scan_update(&gap_scan))
+    return;
+
+  if(find_gaps(&gap_heading) == GAP_NO_SCAN) {
+    // The sensor gave us nothing to go on. Stay down and look again rather than set off blind
+    recorder_trigger(RECORDER_TRIGGER_SCAN);
+    scan_start(&gap_scan);
+    return;
   }
+
+  scanning = false;
+
+  if(fans_automatic()) {  // The console can take the fans over during the sweep now
+    set_thrust_fan_speed(params.thrust_fan_slow);  // Start thrust fan
+    set_lift_fan_speed(params.lift_fan_speed);     // Start lift fan
+  }
+
+  heading_set(heading_setpoint() + ANGLE_Q16(gap_heading));
+  turn_start = millis();
 }
 
-// Find angle that corresponds to the servo pulse in the sweep angles array
-float get_yaw_from_ticks(uint16_t ticks)
+void init_driver()
 {
-  for(int i = 0; i < 7; i++)
+  params_init();  // Before anything that uses a parameter
+  timebase_init();
+  US_init();
+  IR_init();
+  servo_setup(1);
+  imu_init(GYRO_RANGE);
+  if(imu_calibration_load(GYRO_RANGE) != IMU_CAL_OK)
   {
-    if(servo_sweep_angles[SERVO_PULSE_VALUES][i] == ticks)
-    {
-      return(float)(servo_sweep_angles[ANGLE_VALUES][i]);
-    }
+    calibrate_imu();  // Only when there's nothing usable in EEPROM. Needs the craft sitting still and level
+    imu_calibration_save(GYRO_RANGE);
   }
+  imu_fusion_init();
+  heading_init(params.heading_kp, params.heading_ki, params.heading_kd);
+#if IMU_USE_FIFO
+  imu_fifo_init(IMU_SAMPLE_RATE_DIV);
+#endif
 
-  return 0;
+  uart_init_9600();
+
+  fans_init();
+
+  sei();
+}
+
+// Pick a heading from the finished sweep (gap_select.h). Returns GAP_FOUND, GAP_NONE or GAP_NO_SCAN
+uint8_t find_gaps(int8_t *heading)
+{
+  gap_result_t gaps;
+  uint8_t found = gap_select(&gap_scan, US_CLEAR_AHEAD, GAP_MIN_BINS, &gaps);
+
+  *heading = gaps.heading;
+  return found;
 }
 
+
 void fans_init()
 {
   
@@ -301,8 +590,8 @@ void fans_init()
   TCCR0A |= (1 << COM0A1) | (1 << COM0B1) | (1 << WGM01) | (1 << WGM00); // Set to fast pwm, non-inverting mode
   TCCR0B  |= (1 << CS00); // Set clock prescalar to NO PRESCALAR
 
-  OCR0A = THRUST_FAN_MEDIUM;
-  OCR0B = LIFT_FAN_SPEED;
+  OCR0A = params.thrust_fan_medium;
+  OCR0B = params.lift_fan_speed;
 }
 
 void set_lift_fan_speed(uint8_t dutyCycle)
@@ -322,37 +611,43 @@ void reset_angles()
   yaw = 0;
 }
 
-// Gradually straighten servo from current pulse
-void straighten_servo(uint16_t current_pulse)
-{
-  if(current_pulse < SERVO_STRAIGHT)
-  {
-    for(int i = current_pulse; i < SERVO_STRAIGHT; i += 1)
-    {
-      set_servo_pulse(i);
-      _delay_ms(10);
-    }
-  }
-  else
-  {
-    for(int i = current_pulse; i > SERVO_STRAIGHT; i -= 1)
-    {
-      set_servo_pulse(i);
-      _delay_ms(10);
-    }
-  }
 
-  set_servo_pulse(SERVO_STRAIGHT);
+// Report how the last turn went, for tuning the heading gains
+void log_step_response()
+{
+  const heading_metrics_t *m = heading_metrics();
+
+#if TELEMETRY_BINARY
+  telemetry_step_t step;
+
+  step.setpoint = heading_setpoint();
+  step.step = m->step;
+  step.overshoot = m->overshoot;
+  step.rise_ms = m->rise_ms;
+  step.settle_ms = m->settle_ms;
+
+  telemetry_send(TELEMETRY_STEP, &step, sizeof(step));
+#else
+  uart_txString("Turn: rise ");
+  uart_txU16(m->rise_ms);
+  uart_txString(" ms, settle ");
+  uart_txU16(m->settle_ms);
+  uart_txString(" ms, overshoot ");
+  uart_txU16((uint16_t)ANGLE_Q16_TO_INT(m->overshoot));
+  uart_txString(" degrees\n");
+#endif
 }
 
 void print_angles()
 {
+  int16_t int_yaw = ANGLE_Q16_TO_INT(yaw);
+
   uart_txString("Yaw is: ");
-  if(yaw < 0) {
+  if(int_yaw < 0) {
     uart_txChar('-');
-    uart_txU16((uint16_t)(-yaw));
+    uart_txU16((uint16_t)(-int_yaw));
   } else {
-    uart_txU16((uint16_t)yaw);
+    uart_txU16((uint16_t)int_yaw);
   }
   uart_txString(" degrees\n");
 }
\ No newline at end of file
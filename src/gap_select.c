@@ -0,0 +1,105 @@
+#include "gap_select.h"
+
+static int8_t bin_centre(uint8_t bin)
+{
+  return (int8_t)((bin << GAP_BIN_SHIFT) + (GAP_BIN_DEG >> 1) - GAP_HEADING_OFFSET);
+}
+
+static uint16_t min16(uint16_t a, uint16_t b)
+{
+  return (a < b) ? a : b;
+}
+
+uint8_t gap_select(const scan_t *scan, uint16_t clear_cm, uint8_t min_bins, gap_result_t *result)
+{
+  uint16_t bins[GAP_BINS];
+  uint16_t *smooth = result->range_cm;
+
+  // Bin the scan, keeping the closest reading in each bin
+  for(uint8_t i = 0; i < GAP_BINS; i++)
+    bins[i] = GAP_EMPTY;
+
+  uint8_t filled = 0;
+  for(uint8_t i = 0; i < scan->count; i++) {
+    const scan_point_t *p = &scan->points[i];
+    uint8_t bin = (uint8_t)(p->heading + GAP_HEADING_OFFSET) >> GAP_BIN_SHIFT;
+
+    if(bin < GAP_BINS) {
+      bins[bin] = min16(bins[bin], p->range_cm);
+      filled = 1;
+    }
+  }
+
+  // Nothing to fill the empty bins from would make them all read as clear
+  if(!filled || scan->timeouts > scan->count) {
+    for(uint8_t i = 0; i < GAP_BINS; i++)
+      smooth[i] = 0;
+    result->heading = 0;
+    result->width_bins = 0;
+    return GAP_NO_SCAN;
+  }
+
+  // Fill empty bins with the closer of the nearest readings on either side: forward pass, then backward
+  uint16_t last = GAP_EMPTY;
+  for(uint8_t i = 0; i < GAP_BINS; i++) {
+    if(bins[i] == GAP_EMPTY)
+      smooth[i] = last;
+    else
+      last = smooth[i] = bins[i];
+  }
+  last = GAP_EMPTY;
+  for(int8_t i = GAP_BINS - 1; i >= 0; i--) {
+    if(bins[i] == GAP_EMPTY)
+      bins[i] = min16(smooth[i], last);
+    else
+      last = bins[i];
+  }
+
+  // [1 2 1] / 4 smoothing, repeating the edge bins
+  for(uint8_t i = 0; i < GAP_BINS; i++) {
+    uint32_t left = bins[i ? i - 1 : 0];
+    uint32_t right = bins[(i < GAP_BINS - 1) ? i + 1 : i];
+    smooth[i] = (left + 2UL * bins[i] + right) >> 2;
+  }
+
+  // Find the opening that needs the smallest turn. In a wide opening the target is the point closest to
+  // straight ahead that still leaves half the hull width on each side
+  uint8_t found = GAP_NONE, best_turn = 0xFF, furthest = 0;
+  int8_t best_heading = 0;
+  uint8_t best_width = 0;
+  uint8_t run_start = 0, run_length = 0;
+
+  for(uint8_t i = 0; i <= GAP_BINS; i++) {
+    if(i < GAP_BINS && smooth[i] > smooth[furthest])
+      furthest = i;
+
+    if(i < GAP_BINS && smooth[i] > clear_cm) {
+      if(run_length++ == 0)
+        run_start = i;
+      continue;
+    }
+
+    if(run_length >= min_bins) {
+      // Headings that keep the whole hull inside the opening
+      int16_t half_hull = min_bins << (GAP_BIN_SHIFT - 1);
+      int16_t lowest = (run_start << GAP_BIN_SHIFT) - GAP_HEADING_OFFSET + half_hull;
+      int16_t highest = ((run_start + run_length) << GAP_BIN_SHIFT) - GAP_HEADING_OFFSET - half_hull;
+      int8_t heading = (lowest > 0) ? lowest : (highest < 0) ? highest : 0;
+      uint8_t turn = (heading < 0) ? -heading : heading;
+
+      if(turn < best_turn || (turn == best_turn && run_length > best_width)) {
+        best_turn = turn;
+        best_heading = heading;
+        best_width = run_length;
+        found = GAP_FOUND;
+      }
+    }
+
+    run_length = 0;
+  }
+
+  result->heading = found ? best_heading : bin_centre(furthest);
+  result->width_bins = best_width;
+
+  return found;
+}
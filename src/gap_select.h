@@ -0,0 +1,46 @@
+#ifndef gap_select_h
+#define gap_select_h
+
+#include <inttypes.h>
+#include "scan.h"
+
+/*
+  Polar histogram gap selection. The scan is binned by heading (keeping the closest range in each
+  bin), empty bins are filled from their neighbours, the histogram is smoothed with a [1 2 1] filter,
+  and runs of bins further away than the clearance distance are openings. The target is the point
+  in a wide-enough opening that needs the smallest turn.
+
+  A scan with no readings at all, or with more pings unanswered than answered, says nothing about
+  what's out there: it's reported as GAP_NO_SCAN with a heading of 0, never as a clear path.
+
+  No AVR headers and no division, so it builds and runs on the host as well. Every loop is bounded
+  by SCAN_MAX_POINTS or GAP_BINS, so the cost is fixed.
+*/
+
+#define GAP_BIN_SHIFT 3                     // 8 degree bins
+#define GAP_BIN_DEG (1 << GAP_BIN_SHIFT)
+#define GAP_BINS 23                         // -92 to +92 degrees
+#define GAP_HEADING_OFFSET 92               // Heading of the left edge of bin 0, negated
+
+#define GAP_EMPTY 0xFFFF                    // Bin with no readings
+
+// Number of bins a hull width_cm wide needs to fit through a gap dist_cm away (small angle approximation,
+// 57.3 degrees per radian), rounded up. Constant arguments only
+#define GAP_BINS_FOR_WIDTH(width_cm, dist_cm) \
+  (((width_cm) * 573UL + 10UL * GAP_BIN_DEG * (dist_cm) - 1) / (10UL * GAP_BIN_DEG * (dist_cm)))
+
+// gap_select() results
+#define GAP_NONE 0                          // Nothing wide enough: heading is the furthest bin
+#define GAP_FOUND 1                         // heading is in an opening at least min_bins wide
+#define GAP_NO_SCAN 2                       // The scan can't be trusted: don't go anywhere on it
+
+typedef struct {
+  uint16_t range_cm[GAP_BINS];              // Smoothed histogram
+  int8_t heading;                           // Chosen heading in degrees (same convention as the scan)
+  uint8_t width_bins;                       // Width of the chosen opening, 0 if there wasn't one wide enough
+} gap_result_t;
+
+// Returns GAP_FOUND, GAP_NONE or GAP_NO_SCAN
+uint8_t gap_select(const scan_t *scan, uint16_t clear_cm, uint8_t min_bins, gap_result_t *result);
+
+#endif
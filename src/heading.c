@@ -0,0 +1,137 @@
+#include "heading.h"
+#include "timebase.h"
+
+#define HEADING_OUTPUT_LIMIT ANGLE_Q16(90)
+#define HEADING_INTEGRAL_BAND ANGLE_Q16(10)  // Only integrate this close to the setpoint
+
+static int16_t kp, ki, kd;
+static angle_q16_t setpoint = 0;
+static int32_t integral = 0;          // Q16 degrees of servo heading
+static int32_t output = 0;            // Q16, last output
+
+static heading_metrics_t metrics;
+static uint8_t step_pending = 0;      // Set by heading_set(), the step starts at the next update
+static uint32_t step_start_ms;
+static uint32_t band_entered_ms;
+static uint8_t in_band;
+
+void heading_init(int16_t p, int16_t i, int16_t d)
+{
+  kp = p;
+  ki = i;
+  kd = d;
+  integral = 0;
+  output = 0;
+  step_pending = 0;
+  metrics.settled = 1;
+}
+
+void heading_tune(int16_t p, int16_t i, int16_t d)
+{
+  kp = p;
+  ki = i;
+  kd = d;
+}
+
+void heading_set(angle_q16_t new_setpoint)
+{
+  setpoint = new_setpoint;
+  step_pending = 1;
+}
+
+angle_q16_t heading_setpoint()
+{
+  return setpoint;
+}
+
+// Rise time, overshoot and settling time, all from the error so no extra state is needed
+static void heading_track_step(angle_q16_t error)
+{
+  uint32_t now = millis();
+  angle_q16_t magnitude = (error < 0) ? -error : error;
+
+  if(step_pending) {
+    step_pending = 0;
+    metrics.step = error;
+    metrics.overshoot = 0;
+    metrics.rise_ms = 0;
+    metrics.settle_ms = 0;
+    metrics.settled = 0;
+    step_start_ms = now;
+    in_band = 0;
+  }
+
+  if(metrics.settled)
+    return;
+
+  uint16_t elapsed = now - step_start_ms;
+  angle_q16_t step = metrics.step;
+  angle_q16_t past = (step < 0) ? error : -error;     // How far beyond the setpoint we are
+
+  if(step < 0)
+    step = -step;
+
+  if(!metrics.rise_ms && magnitude <= (step >> 8) * 26)  // 26/256, close enough to 10% without a divide
+    metrics.rise_ms = elapsed ? elapsed : 1;
+
+  if(past > metrics.overshoot)
+    metrics.overshoot = past;
+
+  if(magnitude > HEADING_SETTLE_BAND) {
+    in_band = 0;
+  }
+  else if(!in_band) {
+    in_band = 1;
+    band_entered_ms = now;
+  }
+  else if(now - band_entered_ms >= HEADING_SETTLE_HOLD_MS) {
+    metrics.settle_ms = band_entered_ms - step_start_ms;
+    metrics.settled = 1;
+  }
+}
+
+angle_q16_t heading_update(angle_q16_t yaw, angle_q16_t yaw_step)
+{
+  angle_q16_t error = setpoint - yaw;
+
+  // Take the short way round
+  if(error > ANGLE_Q16(180))
+    error -= ANGLE_Q16(360);
+  else if(error < -ANGLE_Q16(180))
+    error += ANGLE_Q16(360);
+
+  heading_track_step(error);
+
+  angle_q16_t magnitude = (error < 0) ? -error : error;
+
+  int32_t e = error >> 8;   // Q8, so a Q8 gain brings it back to Q16 without overflowing
+
+  // Anti-windup: don't integrate during the big part of a turn, or further into saturation. The turn is
+  // rate limited by the craft, not the servo, so integrating on the way round only winds up overshoot
+  if(magnitude <= HEADING_INTEGRAL_BAND && !((output >= HEADING_OUTPUT_LIMIT && e > 0) || (output <= -HEADING_OUTPUT_LIMIT && e < 0))) {
+    integral += (int32_t)ki * e;
+    if(integral > HEADING_OUTPUT_LIMIT)
+      integral = HEADING_OUTPUT_LIMIT;
+    else if(integral < -HEADING_OUTPUT_LIMIT)
+      integral = -HEADING_OUTPUT_LIMIT;
+  }
+
+  output = (int32_t)kp * e + integral - (int32_t)kd * (yaw_step >> 8);
+
+  if(output > HEADING_OUTPUT_LIMIT)
+    output = HEADING_OUTPUT_LIMIT;
+  else if(output < -HEADING_OUTPUT_LIMIT)
+    output = -HEADING_OUTPUT_LIMIT;
+
+  return output;
+}
+
+uint8_t heading_settled()
+{
+  return !step_pending && metrics.settled;
+}
+
+const heading_metrics_t *heading_metrics()
+{
+  return &metrics;
+}
@@ -0,0 +1,45 @@
+#ifndef heading_h
+#define heading_h
+
+#include <inttypes.h>
+#include "IMU.h"
+
+/*
+  Heading controller. PI on the heading error, plus a damping term from the gyro's yaw rate (taken from
+  the measurement rather than differentiating the error, so a new setpoint doesn't kick the servo).
+  The output is a servo heading in Q16.16 degrees: +90 full left, -90 full right, as in convert.h.
+
+  Gains are Q8.8 and per control step, so they don't depend on the steering period. The integral only
+  runs within 10 degrees of the setpoint, is clamped to the output range and stops integrating while
+  the output is saturated (anti-windup).
+*/
+
+#define HEADING_GAIN(x) ((int16_t)((x) * 256 + 0.5))  // Constant arguments only
+
+#define HEADING_SETTLE_BAND ANGLE_Q16(3)  // Settled once within 3 degrees...
+#define HEADING_SETTLE_HOLD_MS 300        // ...for this long
+
+// Step response of the last setpoint change
+typedef struct {
+  angle_q16_t step;         // Size of the step (error when it started)
+  angle_q16_t overshoot;    // Furthest past the setpoint
+  uint16_t rise_ms;         // Time to get within 10% of the step, 0 if it hasn't yet
+  uint16_t settle_ms;       // Time to get inside HEADING_SETTLE_BAND for good, 0 if it hasn't yet
+  uint8_t settled;
+} heading_metrics_t;
+
+void heading_init(int16_t kp, int16_t ki, int16_t kd);
+
+void heading_tune(int16_t kp, int16_t ki, int16_t kd); // Change the gains without resetting anything
+
+void heading_set(angle_q16_t setpoint);   // New absolute heading (same frame as yaw). Starts a new step response
+
+angle_q16_t heading_setpoint();
+
+angle_q16_t heading_update(angle_q16_t yaw, angle_q16_t yaw_step); // yaw_step is how far the current rate turns in one step. Returns the servo heading
+
+uint8_t heading_settled();                // 1 once the last step has settled
+
+const heading_metrics_t *heading_metrics();
+
+#endif
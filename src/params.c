@@ -0,0 +1,195 @@
+#include "params.h"
+#include "UART.h"
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#define PARAM_UINT8 0
+#define PARAM_UINT16 1
+#define PARAM_INT16 2
+
+#define PARAM_TYPE_uint8_t PARAM_UINT8
+#define PARAM_TYPE_uint16_t PARAM_UINT16
+#define PARAM_TYPE_int16_t PARAM_INT16
+
+typedef struct {
+  const char *name;     // In flash
+  uint8_t offset;       // Into params_t
+  uint8_t type;
+  int32_t min, max;
+} param_info_t;
+
+typedef struct {
+  params_t values;
+  uint8_t size;         // sizeof(params_t), so a changed table isn't loaded
+  uint16_t crc;
+} params_record_t;
+
+params_t params;
+
+static const params_t params_defaults PROGMEM = {
+#define PARAM_DEFAULT(type, name, def, min, max) .name = def,
+  PARAMS(PARAM_DEFAULT)
+#undef PARAM_DEFAULT
+};
+
+#define PARAM_NAME(type, name, def, min, max) static const char param_name_##name[] PROGMEM = #name;
+PARAMS(PARAM_NAME)
+#undef PARAM_NAME
+
+static const param_info_t param_info[] PROGMEM = {
+#define PARAM_INFO(type, name, def, min, max) { param_name_##name, offsetof(params_t, name), PARAM_TYPE_##type, min, max },
+  PARAMS(PARAM_INFO)
+#undef PARAM_INFO
+};
+
+#define PARAM_COUNT (sizeof(param_info) / sizeof(param_info[0]))
+
+static params_record_t EEMEM params_eeprom;
+
+static params_record_t save_record;                     // What's being written, so later changes can't tear it
+static uint8_t save_offset = sizeof(params_record_t);   // Next byte to write, sizeof when there's nothing to do
+
+static uint16_t params_crc(const params_record_t *record)
+{
+  const uint8_t *p = (const uint8_t*)record;
+  uint16_t crc = _crc_ccitt_update(0xFFFF, PARAMS_VERSION);
+
+  for(uint8_t i = 0; i < offsetof(params_record_t, crc); i++)
+    crc = _crc_ccitt_update(crc, p[i]);
+
+  return crc;
+}
+
+void params_load_defaults()
+{
+  memcpy_P(&params, &params_defaults, sizeof(params));
+}
+
+uint8_t params_init()
+{
+  params_record_t record;
+
+  params_load_defaults();
+
+  eeprom_read_block(&record, &params_eeprom, sizeof(record));
+  if(record.size != sizeof(params_t) || record.crc != params_crc(&record))
+    return 0;
+
+  params = record.values;
+  return 1;
+}
+
+void params_save()
+{
+  save_record.values = params;
+  save_record.size = sizeof(params_t);
+  save_record.crc = params_crc(&save_record);
+  save_offset = 0;
+}
+
+// An EEPROM write takes 3.3ms, so this starts at most one, and only once the last one has finished.
+// Bytes that are already right are skipped, like eeprom_update_block()
+uint8_t params_save_step()
+{
+  while(save_offset < sizeof(save_record)) {
+    if(!eeprom_is_ready())
+      return 1;
+
+    uint8_t *address = (uint8_t*)&params_eeprom + save_offset;
+    uint8_t value = ((uint8_t*)&save_record)[save_offset++];
+
+    if(eeprom_read_byte(address) != value) {
+      eeprom_write_byte(address, value);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int8_t params_find(const char *name)
+{
+  for(uint8_t i = 0; i < PARAM_COUNT; i++) {
+    if(strcmp_P(name, (const char*)pgm_read_ptr(&param_info[i].name)) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+int32_t params_get(uint8_t index)
+{
+  uint8_t *field = (uint8_t*)&params + pgm_read_byte(&param_info[index].offset);
+
+  switch(pgm_read_byte(&param_info[index].type)) {
+    case PARAM_UINT8:
+      return *field;
+    case PARAM_UINT16:
+      return *(uint16_t*)field;
+    default:
+      return *(int16_t*)field;
+  }
+}
+
+uint8_t params_set(uint8_t index, int32_t value)
+{
+  uint8_t *field = (uint8_t*)&params + pgm_read_byte(&param_info[index].offset);
+
+  if(value < (int32_t)pgm_read_dword(&param_info[index].min) || value > (int32_t)pgm_read_dword(&param_info[index].max))
+    return 1;
+
+  // Parameters can be read from interrupts, so don't let one see half a 16 bit write
+  uint8_t sreg = SREG;
+  cli();
+  switch(pgm_read_byte(&param_info[index].type)) {
+    case PARAM_UINT8:
+      *field = value;
+      break;
+    case PARAM_UINT16:
+      *(uint16_t*)field = value;
+      break;
+    default:
+      *(int16_t*)field = value;
+  }
+  SREG = sreg;
+
+  return 0;
+}
+
+//*************** Printing ***************
+
+static void tx_name(uint8_t index)
+{
+  const char *p = (const char*)pgm_read_ptr(&param_info[index].name);
+  char c;
+
+  while((c = pgm_read_byte(p++)) != '\0')
+    uart_txChar(c);
+}
+
+static void tx_value(int32_t value)
+{
+  if(value < 0) {
+    uart_txChar('-');
+    value = -value;
+  }
+  uart_txU16((uint16_t)value);
+}
+
+uint8_t params_print(uint8_t index)
+{
+  if(index >= PARAM_COUNT)
+    return 0;
+
+  tx_name(index);
+  uart_txString(" = ");
+  tx_value(params_get(index));
+  uart_txChar('\n');
+
+  return 1;
+}
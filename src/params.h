@@ -0,0 +1,56 @@
+#ifndef params_h
+#define params_h
+
+#include <inttypes.h>
+#include "heading.h"
+
+/*
+  Runtime parameters. Defaults live in flash, overrides in EEPROM, and the working copy in RAM, so the
+  hot loop just reads params.name like any other variable. They can be listed, changed and saved from
+  the UART console (console.h).
+
+  X(type, name, default, min, max). Types can be uint8_t, uint16_t or int16_t.
+  Add new parameters at the end; a changed table invalidates what's in EEPROM (PARAMS_VERSION is
+  folded into the CRC, and the size is checked).
+*/
+#define PARAMS(X) \
+  X(uint16_t, us_reading_min, 30, 5, 400)            /* cm, closer than this is an obstacle */ \
+  X(uint16_t, us_slowdown_distance, 85, 5, 400)      /* cm, slow down inside this */ \
+  X(uint8_t, thrust_fan_medium, 175, 0, 255)         /* OCR0A */ \
+  X(uint8_t, thrust_fan_slow, 50, 0, 255) \
+  X(uint8_t, lift_fan_speed, 235, 0, 255)            /* OCR0B */ \
+  X(uint8_t, lift_fan_slow, 225, 0, 255) \
+  X(uint8_t, ir_reading_min, 45, 0, 255)             /* Window that means the end bar is overhead, in 8-bit (ADCH) units */ \
+  X(uint8_t, ir_reading_max, 70, 0, 255) \
+  X(int16_t, heading_kp, HEADING_GAIN(1.5), 0, 4096) /* Q8.8 */ \
+  X(int16_t, heading_ki, HEADING_GAIN(0.02), 0, 1024) \
+  X(int16_t, heading_kd, HEADING_GAIN(14.0), 0, 4096) \
+  X(uint16_t, heading_turn_timeout_ms, 4000, 500, 20000)
+
+#define PARAMS_VERSION 1
+
+typedef struct {
+#define PARAM_FIELD(type, name, def, min, max) type name;
+  PARAMS(PARAM_FIELD)
+#undef PARAM_FIELD
+} params_t;
+
+extern params_t params;
+
+uint8_t params_init();              // Flash defaults, then EEPROM on top if it's valid. Returns 1 if EEPROM was used
+
+void params_save();                 // Start writing the current parameters to EEPROM. params_save_step() does the work
+
+uint8_t params_save_step();         // Write the next byte if the EEPROM is ready, never waiting. Returns 1 until the save is done
+
+void params_load_defaults();
+
+int8_t params_find(const char *name);                 // Index of the parameter called name, or -1
+
+int32_t params_get(uint8_t index);
+
+uint8_t params_set(uint8_t index, int32_t value);     // Returns 0, or 1 if value is out of range
+
+uint8_t params_print(uint8_t index);                  // "name = value" over UART. Returns 0 (and prints nothing) past the last one
+
+#endif
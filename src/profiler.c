@@ -0,0 +1,183 @@
+#include "profiler.h"
+
+#if PROFILER_ENABLE
+
+#include "UART.h"
+#include "IMU.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define STAGE_NAME(name) static const char profile_name_##name[] PROGMEM = #name;
+PROFILE_STAGES(STAGE_NAME)
+#undef STAGE_NAME
+
+static const char * const profile_names[PROFILE_STAGE_COUNT] PROGMEM = {
+#define STAGE_NAME(name) profile_name_##name,
+  PROFILE_STAGES(STAGE_NAME)
+#undef STAGE_NAME
+};
+
+profile_stage_t profile_stages[PROFILE_STAGE_COUNT];
+
+#define PROFILE_AB_RUNS 64
+
+extern float gyro_dps_per_lsb;    // IMU.c, for the float conversions
+
+// Inputs the compiler can't see through, so neither side gets worked out at build time
+static volatile int16_t ab_counts[3] = {-1234, 567, 8901};
+static volatile uint16_t ab_dt_us = 10000;
+
+static angle_q16_t ab_fixed[3];
+static float ab_float[3];
+
+void profile_record(uint8_t stage, uint16_t ticks)
+{
+  profile_stage_t *s = &profile_stages[stage];
+  uint8_t bucket = 0;
+
+  if(s->count == 0xFFFF) {
+    // Keep the average going rather than stopping or wrapping
+    s->count >>= 1;
+    s->total >>= 1;
+  }
+
+  if(s->count == 0 || ticks < s->min)
+    s->min = ticks;
+  if(ticks > s->max)
+    s->max = ticks;
+
+  s->count++;
+  s->total += ticks;
+
+  // Highest set bit, without going past the last bucket
+  for(uint16_t t = ticks >> 1; t && bucket < PROFILE_BUCKETS - 1; t >>= 1)
+    bucket++;
+
+  if(s->buckets[bucket] != 0xFFFF)
+    s->buckets[bucket]++;
+}
+
+void profile_reset(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  memset(profile_stages, 0, sizeof(profile_stages));
+  SREG = sreg;
+}
+
+// Ticks to microseconds, capped at what uart_txU16 can print
+static uint16_t ticks_to_us(uint32_t ticks)
+{
+  uint32_t us = ticks * TIMEBASE_US_PER_TICK;
+
+  return (us > 0xFFFF) ? 0xFFFF : us;
+}
+
+uint8_t profile_print(uint8_t index)
+{
+  profile_stage_t s;
+  uint8_t stage = (index >> 1) - 1;
+
+  // Two header lines, then two lines per stage: the times, and the histogram
+  if(index == 0) {
+    uart_txString("stage count min avg max (us)\n");
+    return 1;
+  }
+  if(index == 1) {
+    uart_txString("  <8 <16 <32 <64 <128 <256 <512 <1024 <2048 more\n");
+    return 1;
+  }
+  if(stage >= PROFILE_STAGE_COUNT)
+    return 0;
+
+  // The ISRs keep recording while this prints, so take a consistent copy
+  uint8_t sreg = SREG;
+  cli();
+  s = profile_stages[stage];
+  SREG = sreg;
+
+  if(!(index & 1)) {
+    // Only on request, so the division for the average is fine
+    uart_txFormatted_P(PSTR("%S %u %u %u %u\n"), (const char*)pgm_read_ptr(&profile_names[stage]), s.count,
+                       ticks_to_us(s.min), ticks_to_us(s.count ? s.total / s.count : 0), ticks_to_us(s.max));
+    return 1;
+  }
+
+  uart_txChar(' ');
+  for(uint8_t b = 0; b < PROFILE_BUCKETS; b++) {
+    uart_txChar(' ');
+    uart_txU16(s.buckets[b]);
+  }
+  uart_txChar('\n');
+
+  return 1;
+}
+
+// What update_gyro_angles_fx() does with a sample
+static void ab_gyro_fixed(void)
+{
+  uint16_t dt_us = ab_dt_us;
+
+  ab_fixed[0] += gyro_rate_to_angle(ab_counts[0], dt_us);
+  ab_fixed[1] += gyro_rate_to_angle(ab_counts[1], dt_us);
+  ab_fixed[2] += gyro_rate_to_angle(ab_counts[2], dt_us);
+}
+
+// What the float path (read_gyro() and update_gyro_angles()) does with the same sample
+static void ab_gyro_float(void)
+{
+  float dt = ab_dt_us * 1e-6;
+
+  ab_float[0] += ab_counts[0] * gyro_dps_per_lsb * dt;
+  ab_float[1] += ab_counts[1] * gyro_dps_per_lsb * dt;
+  ab_float[2] += ab_counts[2] * gyro_dps_per_lsb * dt;
+}
+
+// What uart_txFormatted() was before it had its own formatter
+static void ab_libc_formatted(const char *format, ...)
+{
+  char buffer[64];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  uart_txString(buffer);
+}
+
+uint8_t profile_ab(uint8_t index)
+{
+  if(index > PROFILE_AB_RUNS)
+    return 0;
+
+  if(index == PROFILE_AB_RUNS) {
+    uart_txString("ab done, see profile\n");
+    return 1;
+  }
+
+  PROFILE_BEGIN(ab_gyro_fixed);
+  ab_gyro_fixed();
+  PROFILE_END(ab_gyro_fixed);
+
+  PROFILE_BEGIN(ab_gyro_float);
+  ab_gyro_float();
+  PROFILE_END(ab_gyro_float);
+
+  // Two short lines, which fit in the room console_dump() waits for, so neither waits on the UART
+  PROFILE_BEGIN(ab_fmt_own);
+  uart_txFormatted("ab %d %u\n", ab_counts[0], ab_dt_us);
+  PROFILE_END(ab_fmt_own);
+
+  PROFILE_BEGIN(ab_fmt_libc);
+  ab_libc_formatted("ab %d %u\n", ab_counts[0], ab_dt_us);
+  PROFILE_END(ab_fmt_libc);
+
+  return 1;
+}
+
+#endif
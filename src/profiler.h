@@ -0,0 +1,91 @@
+#ifndef profiler_h
+#define profiler_h
+
+#include <inttypes.h>
+
+/*
+  Stage profiler for the real craft. PROFILE_BEGIN(stage) and PROFILE_END(stage) around a piece of code
+  time it with the Timer2 timebase (timebase_ticks(), 4us per tick) and add the time to that stage's
+  entry in a fixed table in RAM: run count, min, max, a running total for the average, and a histogram.
+  "profile" on the console (console.h) prints the table and "profile reset" clears it.
+
+  With PROFILER_ENABLE 0 the macros are empty and profiler.c compiles to nothing, so it costs no flash,
+  RAM or cycles. Turned on, the table takes about 400 bytes of RAM and each stage adds ~100 cycles.
+
+  BEGIN and END have to be in the same block (BEGIN declares the start time), and each stage is only
+  recorded from one place, either one ISR or the main loop, so recording doesn't need interrupts off.
+
+  "profile ab" times the fixed point gyro integration against the float version it replaced, on the
+  same samples, and uart_txFormatted() against the vsnprintf version it replaced, on the same line,
+  PROFILE_AB_RUNS times each, into the ab_ stages. Only the arithmetic is timed for the gyro; the TWI
+  read is the same for both. A tick is 64 cycles, so read the min and avg columns, not one run.
+*/
+
+#ifndef PROFILER_ENABLE
+#define PROFILER_ENABLE 0
+#endif
+
+#define PROFILE_STAGES(X) \
+  X(imu_read)       /* Draining the MPU's FIFO */ \
+  X(integration)    /* Fusing/integrating what was read */ \
+  X(steering) \
+  X(ranging) \
+  X(ir) \
+  X(telemetry) \
+  X(console) \
+  X(int0)           /* Ultrasonic echo */ \
+  X(int1)           /* MPU data ready */ \
+  X(timer2_ovf)     /* Timebase */ \
+  X(timer1_capt)    /* Servo motion engine */ \
+  X(usart_udre)     /* UART transmit */ \
+  X(usart_rx)       /* UART receive */ \
+  X(twi) \
+  X(adc)            /* IR oversampling, every conversion */ \
+  X(ab_gyro_fixed)  /* Only from "profile ab" (profile_ab()) */ \
+  X(ab_gyro_float) \
+  X(ab_fmt_own) \
+  X(ab_fmt_libc)
+
+// Bucket n counts runs of 2^n to 2^(n+1) - 1 ticks (bucket 0 includes 0). The last one takes everything
+// longer, so with 10 buckets that's 512 ticks (2ms) and up
+#define PROFILE_BUCKETS 10
+
+typedef enum {
+#define PROFILE_ID(name) PROFILE_##name,
+  PROFILE_STAGES(PROFILE_ID)
+#undef PROFILE_ID
+  PROFILE_STAGE_COUNT
+} profile_stage_id_t;
+
+typedef struct {
+  uint16_t count;
+  uint16_t min, max;      // Ticks
+  uint32_t total;         // Ticks, halved along with count when count is about to wrap
+  uint16_t buckets[PROFILE_BUCKETS];  // Saturate at 0xFFFF
+} profile_stage_t;
+
+#if PROFILER_ENABLE
+
+#include "timebase.h"
+
+extern profile_stage_t profile_stages[PROFILE_STAGE_COUNT];
+
+#define PROFILE_BEGIN(stage) uint16_t profile_start_##stage = timebase_ticks()
+#define PROFILE_END(stage) profile_record(PROFILE_##stage, timebase_ticks() - profile_start_##stage)
+
+void profile_record(uint8_t stage, uint16_t ticks);
+
+void profile_reset(void);
+
+uint8_t profile_print(uint8_t index);  // One line of the table over UART, for console_dump(). Returns 0 past the end
+
+uint8_t profile_ab(uint8_t index);     // One A/B run, for console_dump(). Returns 0 when they're all done
+
+#else
+
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+
+#endif
+
+#endif
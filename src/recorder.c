@@ -0,0 +1,208 @@
+#include "recorder.h"
+#include "telemetry.h"
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#define CHUNKS_PER_BLOCK (RECORDER_BLOCK_BYTES / RECORDER_CHUNK_BYTES)
+#define BLOCK_BITS (RECORDER_BLOCK_BYTES * 8)
+
+#define CODE_SAME 0       // 0
+#define CODE_SMALL 1      // 10 + 4 bits
+#define CODE_BYTE 2       // 110 + 8 bits
+#define CODE_RAW 3        // 111 + the field's bits
+
+static uint8_t blocks[RECORDER_BLOCKS][RECORDER_BLOCK_BYTES];
+static uint16_t block_bits;             // Bits used in the current block
+static uint8_t current = 0;             // Block being written
+static uint8_t sequence = 0;            // The current block's sequence number
+static uint8_t filled = 0;              // Blocks with something in them
+static recorder_frame_t last;           // The previous frame, what deltas are against
+
+static uint8_t reason = RECORDER_RUNNING;
+static uint8_t post_frames;             // Still to record after the trigger
+static uint8_t frozen = 0;
+static uint16_t trigger_time_ms;
+
+static const uint8_t field_bits[RECORDER_FIELD_COUNT] PROGMEM = {
+#define FIELD_BITS(name, bits, shift, step) bits,
+  RECORDER_FIELDS(FIELD_BITS)
+#undef FIELD_BITS
+};
+
+static const int16_t field_step[RECORDER_FIELD_COUNT] PROGMEM = {
+#define FIELD_STEP(name, bits, shift, step) step,
+  RECORDER_FIELDS(FIELD_STEP)
+#undef FIELD_STEP
+};
+
+
+// Write the low count bits of value, most significant first
+static void put_bits(uint16_t value, uint8_t count)
+{
+  uint8_t *block = blocks[current];
+
+  while(count--) {
+    uint8_t *byte = &block[block_bits >> 3];
+    uint8_t mask = 0x80 >> (block_bits & 7);
+
+    if(value & (1U << count))
+      *byte |= mask;
+    else
+      *byte &= ~mask;
+
+    block_bits++;
+  }
+}
+
+static void start_block(const recorder_frame_t *frame)
+{
+  const int16_t *values = (const int16_t*)frame;
+
+  if(filled) {
+    current = (current + 1) % RECORDER_BLOCKS;
+    sequence++;
+  }
+  if(filled < RECORDER_BLOCKS)
+    filled++;
+
+  blocks[current][0] = sequence;
+  blocks[current][1] = 1;   // Frames, counting the keyframe
+  block_bits = RECORDER_HEADER_BYTES * 8;
+
+  for(uint8_t i = 0; i < RECORDER_FIELD_COUNT; i++)
+    put_bits(values[i], pgm_read_byte(&field_bits[i]));
+}
+
+void recorder_add(const recorder_frame_t *frame)
+{
+  const int16_t *values = (const int16_t*)frame;
+  const int16_t *previous = (const int16_t*)&last;
+  uint8_t codes[RECORDER_FIELD_COUNT];
+  uint16_t zigzag[RECORDER_FIELD_COUNT];
+  uint16_t bits = 0;
+
+  if(frozen)
+    return;
+
+  if(reason != RECORDER_RUNNING && post_frames-- == 0) {
+    frozen = 1;
+    return;
+  }
+
+  // Work out every field's code first, to know whether the frame fits in this block
+  for(uint8_t i = 0; i < RECORDER_FIELD_COUNT; i++) {
+    uint8_t width = pgm_read_byte(&field_bits[i]);
+    int16_t delta = values[i] - (int16_t)(previous[i] + (int16_t)pgm_read_word(&field_step[i]));
+
+    if(width == 8)
+      delta = (int8_t)delta;  // 8-bit fields wrap at 8 bits
+    zigzag[i] = ((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15);
+
+    if(zigzag[i] == 0) {
+      codes[i] = CODE_SAME;
+      bits += 1;
+    } else if(zigzag[i] < 16) {
+      codes[i] = CODE_SMALL;
+      bits += 2 + 4;
+    } else if(zigzag[i] < 256) {
+      codes[i] = CODE_BYTE;
+      bits += 3 + 8;
+    } else {
+      codes[i] = CODE_RAW;
+      bits += 3 + width;
+    }
+  }
+
+  if(!filled || blocks[current][1] == 0xFF || block_bits + bits > BLOCK_BITS) {
+    start_block(frame);
+  }
+  else {
+    for(uint8_t i = 0; i < RECORDER_FIELD_COUNT; i++) {
+      switch(codes[i]) {
+        case CODE_SAME:
+          put_bits(0, 1);
+          break;
+        case CODE_SMALL:
+          put_bits(0x2, 2);
+          put_bits(zigzag[i], 4);
+          break;
+        case CODE_BYTE:
+          put_bits(0x6, 3);
+          put_bits(zigzag[i], 8);
+          break;
+        default:
+          put_bits(0x7, 3);
+          put_bits(values[i], pgm_read_byte(&field_bits[i]));
+      }
+    }
+    blocks[current][1]++;
+  }
+
+  last = *frame;
+}
+
+void recorder_trigger(uint8_t why)
+{
+  if(reason != RECORDER_RUNNING)
+    return;
+
+  reason = why;
+  post_frames = RECORDER_POST_FRAMES;
+  trigger_time_ms = last.time_ms;
+}
+
+void recorder_freeze(uint8_t why)
+{
+  recorder_trigger(why);
+  frozen = 1;
+}
+
+void recorder_clear(void)
+{
+  memset(blocks, 0, sizeof(blocks));
+  filled = 0;
+  current = 0;
+  sequence = 0;
+  reason = RECORDER_RUNNING;
+  frozen = 0;
+}
+
+uint8_t recorder_state(void)
+{
+  return reason;
+}
+
+uint8_t recorder_frozen(void)
+{
+  return frozen;
+}
+
+uint8_t recorder_dump_packet(uint8_t index)
+{
+  uint8_t block = index / CHUNKS_PER_BLOCK;
+
+  if(block < filled) {
+    // Oldest first: block 0 until they've all been used, then the one after the current block
+    uint8_t b = (current + RECORDER_BLOCKS - filled + 1 + block) % RECORDER_BLOCKS;
+    recorder_chunk_t chunk;
+    uint8_t offset = (index % CHUNKS_PER_BLOCK) * RECORDER_CHUNK_BYTES;
+
+    chunk.block = blocks[b][0];
+    chunk.offset = offset;
+    memcpy(chunk.data, &blocks[b][offset], RECORDER_CHUNK_BYTES);
+    telemetry_send(TELEMETRY_RECORDER_CHUNK, &chunk, sizeof(chunk));
+    return 1;
+  }
+
+  if(block == filled && index % CHUNKS_PER_BLOCK == 0) {
+    recorder_end_t end;
+
+    end.reason = reason;
+    end.blocks = filled;
+    end.trigger_time_ms = trigger_time_ms;
+    telemetry_send(TELEMETRY_RECORDER_END, &end, sizeof(end));
+    return 1;
+  }
+
+  return 0;
+}
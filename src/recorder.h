@@ -0,0 +1,96 @@
+#ifndef recorder_h
+#define recorder_h
+
+#include <inttypes.h>
+
+/*
+  Flight recorder. Every RECORDER_PERIOD_MS the driver hands recorder_add() a frame of scaled-down state,
+  and the last few seconds of frames are kept in RECORDER_BLOCKS blocks of RAM. When a block is full the
+  oldest one is reused, so history is lost a block at a time.
+
+  A block is
+    sequence number (1 byte) | frame count (1 byte) | keyframe | delta frames...
+  bit packed, most significant bit first. The keyframe has every field at its full width. Each field of
+  a delta frame is coded against its value in the frame before (plus its step, so time costs nothing
+  when a frame is on time):
+    0                       unchanged
+    10   + 4 bits           zigzag delta 0..15 (so -8..7)
+    110  + 8 bits           zigzag delta 0..255
+    111  + the field's bits the new value
+  Zigzag maps 0, -1, 1, -2, 2... to 0, 1, 2, 3, 4...
+
+  recorder_trigger() keeps recording for RECORDER_POST_FRAMES more frames and then freezes the
+  buffer until recorder_clear(), so what led up to the trigger and a little of what followed is kept.
+  The dump is sent as telemetry packets (telemetry.h): RECORDER_CHUNK_BYTES of a block at a time, oldest
+  block first, then a TELEMETRY_RECORDER_END packet. tools/telemetry_decode turns it back into frames.
+
+  This header is shared with the host-side decoder, so it must not include any AVR headers.
+*/
+
+#define RECORDER_BLOCKS 4
+#define RECORDER_BLOCK_BYTES 128
+#define RECORDER_PERIOD_MS 50
+#define RECORDER_POST_FRAMES 20       // Frames recorded after a trigger, 1s
+#define RECORDER_CHUNK_BYTES 32       // Block bytes per dump packet
+
+#define RECORDER_HEADER_BYTES 2
+
+// X(name, bits, shift, step): bits stored (values are int16_t, 8-bit fields 0-255), how far the driver
+// shifts the value right before storing it, and how much it's expected to change per frame
+#define RECORDER_FIELDS(X) \
+  X(time_ms, 16, 0, RECORDER_PERIOD_MS)   /* Low 16 bits of millis() */ \
+  X(yaw, 16, 10, 0)                       /* Q16.16 degrees >> 10: 1/64 degree */ \
+  X(roll, 16, 10, 0) \
+  X(pitch, 16, 10, 0) \
+  X(gyro_z, 16, 2, 0)                     /* Counts, bias removed */ \
+  X(accel_x, 16, 4, 0)                    /* Counts >> 4: 1/1024 g at +-2g */ \
+  X(accel_y, 16, 4, 0) \
+  X(range_cm, 16, 0, 0) \
+  X(servo_pulse, 16, 0, 0)                /* OCR1A */ \
+  X(thrust_fan, 8, 0, 0)                  /* OCR0A */ \
+  X(lift_fan, 8, 0, 0)                    /* OCR0B */ \
+  X(flags, 8, 0, 0)                       /* TELEMETRY_FLAG_ */
+
+typedef struct {
+#define RECORDER_FIELD(name, bits, shift, step) int16_t name;
+  RECORDER_FIELDS(RECORDER_FIELD)
+#undef RECORDER_FIELD
+} recorder_frame_t;
+
+#define RECORDER_FIELD_COUNT (sizeof(recorder_frame_t) / sizeof(int16_t))
+
+// Why the recorder froze
+#define RECORDER_RUNNING 0
+#define RECORDER_TRIGGER_BUMP 1       // The accelerometer saw a hit
+#define RECORDER_TRIGGER_TIMEOUT 2    // A turn never settled
+#define RECORDER_TRIGGER_COMMAND 3    // From the console
+#define RECORDER_TRIGGER_END 4        // End of the course
+#define RECORDER_TRIGGER_SCAN 5       // An obstacle scan came back with nothing usable in it
+
+typedef struct __attribute__((packed)) {
+  uint8_t block;                      // Block sequence number
+  uint8_t offset;                     // Byte offset of data[] in the block
+  uint8_t data[RECORDER_CHUNK_BYTES];
+} recorder_chunk_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t reason;                     // RECORDER_TRIGGER_, or RECORDER_RUNNING if it was dumped without one
+  uint8_t blocks;                     // Blocks sent
+  uint16_t trigger_time_ms;           // Low 16 bits of millis() at the trigger
+} recorder_end_t;
+
+void recorder_add(const recorder_frame_t *frame);   // Append a frame, unless frozen
+
+void recorder_trigger(uint8_t reason);              // Freeze after RECORDER_POST_FRAMES more frames. Later triggers are ignored
+
+void recorder_freeze(uint8_t reason);               // Freeze now
+
+void recorder_clear(void);                          // Empty the buffer and start recording again
+
+uint8_t recorder_state(void);                       // RECORDER_RUNNING, or the trigger reason
+
+uint8_t recorder_frozen(void);                      // 1 once nothing more is being recorded
+
+uint8_t recorder_dump_packet(uint8_t index);        // Send dump packet index, for console_dump(). Returns 0 past the end
+
+#endif
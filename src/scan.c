@@ -0,0 +1,103 @@
+#include "scan.h"
+#include "US_sensor.h"
+#include "timer1_servo.h"
+#include "timebase.h"
+#include "convert.h"
+
+#define SCAN_SETTLING 0
+#define SCAN_SWEEPING 1
+#define SCAN_DONE 2
+
+// Sweep speed in ticks per us, Q20. Lets the pulse be worked out for any time without dividing
+#define SCAN_RATE RECIPROCAL(SCAN_STEP_TICKS, 20000, 20)
+
+static uint8_t scan_state = SCAN_DONE;
+static uint32_t settle_start_ms;     // millis() when the servo was sent to the start of the sweep
+static uint32_t sweep_start_us;      // micros() when the sweep started
+static uint32_t ping_time;           // micros() when the current ping was triggered
+static uint32_t last_ping_ms;
+static uint8_t ping_outstanding = 0;
+
+// Commanded pulse at time t (micros) during the sweep
+static uint16_t scan_pulse_at(uint32_t t)
+{
+  int32_t elapsed = t - sweep_start_us;
+
+  if(elapsed <= 0)
+    return SERVO_MIN;
+
+  uint32_t offset = ((uint32_t)elapsed * SCAN_RATE) >> 20;
+
+  return (offset >= SERVO_MAX - SERVO_MIN) ? SERVO_MAX : SERVO_MIN + offset;
+}
+
+// Store a finished ping, tagged with where the sensor was pointing when the sound hit the obstacle
+static void scan_record(scan_t *scan, const us_result_t *r)
+{
+  if(r->status == US_TIMEOUT) {
+    scan->timeouts++;
+    return;
+  }
+
+  if(scan->count >= SCAN_MAX_POINTS)
+    return;
+
+  scan_point_t *p = &scan->points[scan->count++];
+
+  p->timestamp = ping_time + (r->echo_us >> 1);
+  p->pulse = scan_pulse_at(p->timestamp - SCAN_SERVO_LAG_US);
+  p->heading = servo_pulse_to_heading(p->pulse);
+  p->range_cm = (r->status == US_READY) ? r->distance_cm : US_NO_ECHO_DISTANCE;
+}
+
+void scan_start(scan_t *scan)
+{
+  scan->count = 0;
+  scan->timeouts = 0;
+  ping_outstanding = 0;
+
+  set_servo_pulse(SERVO_MIN);
+  settle_start_ms = millis();
+  scan_state = SCAN_SETTLING;
+}
+
+uint8_t scan_update(scan_t *scan)
+{
+  us_result_t result;
+
+  switch(scan_state) {
+    case SCAN_SETTLING:
+      if(millis() - settle_start_ms >= SCAN_SETTLE_MS) {
+        servo_move_to(SERVO_MAX, SERVO_RATE_PER_FRAME(SCAN_STEP_TICKS), SERVO_NO_LIMIT); // Timer1 does the sweep
+        sweep_start_us = micros();
+        last_ping_ms = millis() - SCAN_PING_GAP_MS;
+        scan_state = SCAN_SWEEPING;
+      }
+      break;
+
+    case SCAN_SWEEPING: {
+      if(US_poll() == US_BUSY)
+        break;
+
+      if(ping_outstanding && US_get_result(&result))
+        scan_record(scan, &result);
+      ping_outstanding = 0;
+
+      if(!servo_moving()) {
+        scan_state = SCAN_DONE;
+        break;
+      }
+
+      if(millis() - last_ping_ms >= SCAN_PING_GAP_MS) {
+        last_ping_ms = millis();
+        ping_time = micros();
+        US_get_result(&result);  // Make sure an old result isn't mistaken for this ping's
+        US_start();
+        ping_outstanding = 1;
+      }
+      break;
+    }
+  }
+
+  return scan_state == SCAN_DONE;
+}
@@ -0,0 +1,35 @@
+#ifndef scan_h
+#define scan_h
+
+#include <inttypes.h>
+
+/*
+  Continuous scan: the servo sweeps from SERVO_MIN to SERVO_MAX at a fixed rate (run by the Timer1
+  motion engine) while the ultrasonic sensor pings back to back. Each range is tagged with the heading the sensor was pointing at when the
+  sound bounced back, worked out from the sweep rate and the echo timestamps.
+*/
+
+#define SCAN_MAX_POINTS 24
+#define SCAN_STEP_TICKS 8         // Servo ticks per 20ms PWM frame. 205 ticks take ~0.5s
+#define SCAN_SETTLE_MS 250        // Time for the servo to get to the start of the sweep
+#define SCAN_PING_GAP_MS 25       // Minimum time between pings, so a late echo isn't taken for the next one
+#define SCAN_SERVO_LAG_US 40000   // How far the servo horn lags behind the commanded pulse
+
+typedef struct {
+  int8_t heading;                 // Degrees. +90 at SERVO_MIN, 0 straight ahead, -90 at SERVO_MAX
+  uint16_t pulse;                 // Servo pulse the sensor was pointing at
+  uint16_t range_cm;              // US_NO_ECHO_DISTANCE if nothing was in range
+  uint32_t timestamp;             // micros() when the sound reached the obstacle
+} scan_point_t;
+
+typedef struct {
+  scan_point_t points[SCAN_MAX_POINTS];
+  uint8_t count;
+  uint8_t timeouts;               // Pings the sensor never answered. Not in points, but a dead sensor shows up here
+} scan_t;
+
+void scan_start(scan_t *scan);    // Move the servo to the start of the sweep and clear the scan
+
+uint8_t scan_update(scan_t *scan); // Call as often as possible. Returns 1 once the sweep is finished
+
+#endif
@@ -0,0 +1,73 @@
+#include "scheduler.h"
+#include "timebase.h"
+#include "UART.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+void scheduler_init(task_t *tasks, uint8_t count)
+{
+  uint16_t now = millis();
+
+  for(uint8_t i = 0; i < count; i++) {
+    tasks[i].next_run = now;
+    tasks[i].overruns = 0;
+    tasks[i].max_time_us = 0;
+  }
+}
+
+void scheduler_run_once(task_t *tasks, uint8_t count)
+{
+  uint8_t ran = 0;
+
+  for(uint8_t i = 0; i < count; i++) {
+    task_t *task = &tasks[i];
+    uint16_t now = millis();
+    int16_t late = now - task->next_run;  // Signed difference, so millis() wrapping around is fine
+
+    if(late < 0)
+      continue; // Not due yet
+
+    if(late >= (int16_t)task->period_ms) {
+      // Missed at least one release. Don't try to catch up, just start again from now
+      task->overruns++;
+      task->next_run = now + task->period_ms;
+    } else {
+      task->next_run += task->period_ms; // Keeps the rate exact even when a run starts a bit late
+    }
+
+    uint32_t start = micros();
+    task->run();
+    uint32_t elapsed = micros() - start;
+
+    if(elapsed > task->max_time_us)
+      task->max_time_us = (elapsed > 0xFFFF) ? 0xFFFF : elapsed;
+
+    if(elapsed >= (uint32_t)task->period_ms * 1000)
+      task->overruns++;
+
+    ran = 1;
+  }
+
+  if(!ran) {
+    // Nothing due: sleep until the next interrupt (at the latest, the next Timer2 overflow)
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+  }
+}
+
+void scheduler_print_task(const task_t *task)
+{
+  uart_txString(task->name);
+  uart_txString(": overruns ");
+  uart_txU16(task->overruns);
+  uart_txString(", max ");
+  uart_txU16(task->max_time_us);
+  uart_txString("us\n");
+}
+
+void scheduler_print_stats(task_t *tasks, uint8_t count)
+{
+  for(uint8_t i = 0; i < count; i++)
+    scheduler_print_task(&tasks[i]);
+}
@@ -0,0 +1,32 @@
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <inttypes.h>
+
+/*
+  Cooperative fixed-rate scheduler. Each task runs to completion every period_ms milliseconds,
+  timed from millis(), and the CPU idles between Timer2 ticks when nothing is due.
+  A task counts an overrun when it is released a whole period (or more) late, or when a single run
+  takes longer than its period.
+*/
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+  uint16_t period_ms;
+  uint16_t next_run;      // Low 16 bits of millis() when the task is next due
+  uint16_t overruns;
+  uint16_t max_time_us;   // Longest single run seen
+} task_t;
+
+#define TASK(name, fn, period_ms) {name, fn, period_ms, 0, 0, 0}
+
+void scheduler_init(task_t *tasks, uint8_t count);        // Make every task due now
+
+void scheduler_run_once(task_t *tasks, uint8_t count);    // Run the tasks that are due, or idle until the next tick
+
+void scheduler_print_stats(task_t *tasks, uint8_t count); // Overruns and worst-case run times over UART
+
+void scheduler_print_task(const task_t *task);            // The same for one task, on one line
+
+#endif
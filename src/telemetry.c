@@ -0,0 +1,74 @@
+#include "telemetry.h"
+#include "timebase.h"
+#include "UART.h"
+#include <string.h>
+
+static uint8_t telemetry_seq = 0;
+uint16_t telemetry_dropped = 0;
+
+/*
+  COBS: each run of non-zero bytes is sent as (run length + 1) followed by the run, and the zero
+  that ended it is implied. A run of 254 bytes is sent with code 0xFF and no implied zero.
+  The whole packet is already in RAM, so this scans ahead for each run instead of copying into a
+  second buffer.
+*/
+static void cobs_send(const uint8_t *data, uint8_t length)
+{
+  uint8_t start = 0;
+
+  while(1) {
+    uint8_t end = start;
+    while(end < length && data[end] != 0 && end - start < 254)
+      end++;
+
+    uart_txChar(end - start + 1);
+    for(uint8_t i = start; i < end; i++)
+      uart_txChar(data[i]);
+
+    if(end == length) {
+      break;
+    }
+    else if(data[end] == 0) {
+      start = end + 1;
+      if(start == length) {
+        uart_txChar(1); // Packet ended with a zero
+        break;
+      }
+    }
+    else {
+      start = end;    // 254 byte run, no zero to skip
+    }
+  }
+
+  uart_txChar(0);   // End of frame
+}
+
+void telemetry_send(uint8_t type, const void *payload, uint8_t length)
+{
+  uint8_t packet[TELEMETRY_MAX_PACKET];
+  telemetry_header_t *header = (telemetry_header_t*)packet;
+  uint8_t size = sizeof(telemetry_header_t) + length;
+  uint16_t crc = 0xFFFF;
+
+  if(size + 2 > TELEMETRY_MAX_PACKET)
+    return;
+
+  // COBS adds one byte to anything this short, then there's the 0x00
+  if(!uart_txRoom(size + 2 + 2)) {
+    telemetry_dropped++;
+    return;
+  }
+
+  header->type = type;
+  header->seq = telemetry_seq++;
+  header->time_us = micros();
+  memcpy(packet + sizeof(telemetry_header_t), payload, length);
+
+  for(uint8_t i = 0; i < size; i++)
+    crc = telemetry_crc_update(crc, packet[i]);
+
+  packet[size++] = crc & 0xFF;
+  packet[size++] = crc >> 8;
+
+  cobs_send(packet, size);
+}
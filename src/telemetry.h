@@ -0,0 +1,71 @@
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <inttypes.h>
+
+/*
+  Binary telemetry. Every packet is
+    type (1 byte) | sequence number (1 byte) | micros() timestamp (4 bytes) | payload | CRC-16 (2 bytes)
+  little endian, with the CRC (CCITT, as computed by avr-libc's _crc_ccitt_update, starting from 0xFFFF)
+  covering everything before it. The packet is COBS encoded so it contains no zero bytes, and a 0x00
+  marks the end of each frame. A receiver that starts mid-stream just waits for the next 0x00.
+
+  This header is shared with the host-side decoder in tools/, so it must not include any AVR headers.
+*/
+
+#define TELEMETRY_MAX_PACKET 64   // Header + payload + CRC, before COBS encoding
+
+#define TELEMETRY_STATE 1         // Payload is a telemetry_state_t
+#define TELEMETRY_STEP 2          // Payload is a telemetry_step_t, sent when a heading change settles
+#define TELEMETRY_RECORDER_CHUNK 3  // Payload is a recorder_chunk_t (recorder.h), part of a flight recorder dump
+#define TELEMETRY_RECORDER_END 4    // Payload is a recorder_end_t, after the last chunk
+
+// Bits in telemetry_state_t.flags
+#define TELEMETRY_FLAG_OBSTACLE 0x01  // Ranging has flagged an obstacle
+#define TELEMETRY_FLAG_AVOIDING 0x02  // Stopped, looking for a gap or turning
+#define TELEMETRY_FLAG_END 0x04       // End of course detected
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;
+  uint8_t seq;
+  uint32_t time_us;
+} telemetry_header_t;
+
+typedef struct __attribute__((packed)) {
+  int16_t accel_x, accel_y, accel_z;  // Raw counts
+  int16_t gyro_x, gyro_y, gyro_z;     // Counts with the bias removed
+  int32_t roll, pitch, yaw;           // Q16.16 degrees
+  uint16_t range_cm;
+  uint16_t servo_pulse;               // OCR1A
+  uint8_t thrust_fan, lift_fan;       // OCR0A, OCR0B
+  uint8_t flags;
+} telemetry_state_t;
+
+// Heading controller step response (see heading.h)
+typedef struct __attribute__((packed)) {
+  int32_t setpoint;                   // Q16.16 degrees
+  int32_t step;                       // Q16.16 degrees
+  int32_t overshoot;                  // Q16.16 degrees
+  uint16_t rise_ms, settle_ms;        // 0 if it never got there
+} telemetry_step_t;
+
+// CRC-16/CCITT update, identical to avr-libc's _crc_ccitt_update()
+#ifdef __AVR__
+#include <util/crc16.h>
+#define telemetry_crc_update _crc_ccitt_update
+#else
+static inline uint16_t telemetry_crc_update(uint16_t crc, uint8_t data)
+{
+  data ^= crc & 0xFF;
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+#endif
+
+// Frame and queue one packet on the UART. All or nothing: a packet that wouldn't fit in the transmit buffer is
+// counted in telemetry_dropped and not sent, so a partial frame never runs into the next one
+void telemetry_send(uint8_t type, const void *payload, uint8_t length);
+
+extern uint16_t telemetry_dropped;
+
+#endif
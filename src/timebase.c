@@ -0,0 +1,92 @@
+#include "timebase.h"
+#include "profiler.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/*
+  Timer2 counts 16MHz / 64 = 250kHz, so TCNT2 ticks every 4us and overflows every 256 * 4 = 1024us.
+  micros() is just (overflows << 10) | (TCNT2 << 2), so there's no division anywhere.
+  millis() uses the same trick as the Arduino core: each overflow is 1ms plus 24us, and the 24us
+  remainders are collected (in units of 8us) until they add up to another whole millisecond.
+*/
+#define MILLIS_INC 1          // Whole milliseconds per overflow
+#define FRACT_INC (24 >> 3)   // Leftover 24us per overflow, in units of 8us
+#define FRACT_MAX (1000 >> 3) // One millisecond in units of 8us
+
+volatile uint32_t timer2_overflows = 0;
+volatile uint32_t timer2_millis = 0;
+static uint8_t timer2_fract = 0;
+
+ISR(TIMER2_OVF_vect)
+{
+  timer2_overflows++; // First, so the profiler's timestamps below already include this overflow
+
+  PROFILE_BEGIN(timer2_ovf);
+
+  uint32_t m = timer2_millis + MILLIS_INC;
+  uint8_t f = timer2_fract + FRACT_INC;
+
+  if(f >= FRACT_MAX) {
+    f -= FRACT_MAX;
+    m++;
+  }
+
+  timer2_fract = f;
+  timer2_millis = m;
+
+  PROFILE_END(timer2_ovf);
+}
+
+void timebase_init(void)
+{
+  TCCR2A = 0;             // Normal mode
+  TCNT2 = 0;
+  TIFR2 = (1 << TOV2);    // Clear any old overflow
+  TIMSK2 = (1 << TOIE2);  // Enable Timer2 overflow interrupt
+  TCCR2B = (1 << CS22);   // Start Timer2 with prescaler 64
+}
+
+uint32_t micros(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+
+  uint32_t overflows = timer2_overflows;
+  uint8_t ticks = TCNT2;
+
+  // The timer may have overflowed since interrupts were disabled without the ISR having run yet
+  if((TIFR2 & (1 << TOV2)) && ticks < 255)
+    overflows++;
+
+  SREG = sreg;
+
+  return (overflows << 10) | ((uint16_t)ticks << 2);
+}
+
+uint16_t timebase_ticks(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+
+  uint8_t overflows = timer2_overflows;
+  uint8_t ticks = TCNT2;
+
+  if((TIFR2 & (1 << TOV2)) && ticks < 255)
+    overflows++;
+
+  SREG = sreg;
+
+  return ((uint16_t)overflows << 8) | ticks;
+}
+
+uint32_t millis(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+
+  uint32_t m = timer2_millis;
+
+  SREG = sreg;
+
+  return m;
+}
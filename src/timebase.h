@@ -0,0 +1,21 @@
+#ifndef timebase_h
+#define timebase_h
+
+#include <inttypes.h>
+
+/*
+  Free-running system time from Timer/Counter2 (prescaler 64, so one tick is 4us and the timer
+  overflows every 1024us). Everything that needs to timestamp something uses micros().
+*/
+
+#define TIMEBASE_US_PER_TICK 4
+
+void timebase_init(void);
+
+uint32_t micros(void);   // Microseconds since timebase_init(), 4us resolution. Wraps after ~71 minutes
+
+uint32_t millis(void);   // Milliseconds since timebase_init()
+
+uint16_t timebase_ticks(void);  // Raw 4us ticks, wrapping every 262ms. Cheaper than micros() for timing short things
+
+#endif
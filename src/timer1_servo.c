@@ -1,4 +1,6 @@
 #include "timer1_servo.h"
+#include "convert.h"
+#include "profiler.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/delay.h>
@@ -6,7 +8,6 @@
   A lot of the initialisation code is from the init.c file that Dmitry posted
   on the Moodle course page.
 */
-#define F_CPU 16000000UL
 
 /* 
   Constant for Timer1 50 Hz PWM (ICR mode)
@@ -16,60 +17,166 @@
 */
 #define PWM_TOP 2500  // From phase and frequency correct PWM frequency formula (datasheet p. 137)
 
-/* 
-  Again, these values are calculated from the PWM frequency formula on p.137
-  Rearranging that formula, you get COUNT = pulse_duration * f_(clk) / (2 * 64)
+// SERVO_MIN, SERVO_MIDDLE and SERVO_MAX are in convert.h, which works out the angle conversion from them
+
+// ======= Servo motion engine ===================
+/*
+  With ICR1 as TOP the input capture flag is set once per PWM frame, when the counter turns around
+  at TOP. OCR1A is double buffered and only loaded at BOTTOM, so writing it here always lands cleanly
+  on the next pulse. Position and speed are in 1/256 ticks so slow moves don't stall on rounding.
 */
-#define SERVO_MIN 85
-#define SERVO_MIDDLE 188
-#define SERVO_MAX 290
+static volatile uint16_t servo_target = SERVO_MIDDLE;
+static volatile uint16_t servo_max_rate = SERVO_NO_LIMIT;  // 1/256 ticks per frame
+static volatile uint16_t servo_accel = SERVO_NO_LIMIT;     // 1/256 ticks per frame per frame
+static volatile uint8_t servo_jump = 0;                    // Set by set_servo_pulse() to skip the trajectory
+
+static int32_t servo_position_q8 = (int32_t)SERVO_MIDDLE << 8;
+static int16_t servo_velocity_q8 = 0;
+static volatile uint16_t servo_output = SERVO_MIDDLE;      // Last value written to OCR1A
+static uint8_t servo_irq = 0;
+
+// One step of a trapezoidal profile: speed up to max_rate, and start braking once the
+// stopping distance v^2 / 2a reaches what's left (compared without dividing)
+static void servo_step()
+{
+  int32_t target = (int32_t)servo_target << 8;
+  int32_t error = target - servo_position_q8;
+  int32_t distance = (error < 0) ? -error : error;
+  int16_t rate = servo_max_rate;
+  int16_t accel = servo_accel;
 
-// ======= PWM0 and PWM1 control (16-bit timer1) ===================
-// Perhaps use this later
-// ISR for input capture interrupt
+  if(servo_jump || rate == SERVO_NO_LIMIT) {
+    servo_position_q8 = target;
+    servo_velocity_q8 = 0;
+    servo_jump = 0;
+    return;
+  }
+
+  if(error == 0 && servo_velocity_q8 == 0)
+    return;
+
+  int8_t dir = (error > 0) ? 1 : -1;
+  int16_t speed = servo_velocity_q8 * dir;   // Positive when heading towards the target
+
+  if(accel == SERVO_NO_LIMIT)
+    speed = rate;
+  else if(speed < 0)
+    speed = (speed + accel > 0) ? 0 : speed + accel;  // Wrong way: stop before turning round
+  else if((int32_t)speed * speed >= 2L * accel * distance)
+    speed -= accel;                 // Time to brake
+  else if(speed < rate)
+    speed = (speed + accel > rate) ? rate : speed + accel;
+  else
+    speed = rate;                   // Rate was lowered while moving
+
+  if(speed >= distance) {
+    servo_position_q8 = target;     // Arrived
+    servo_velocity_q8 = 0;
+    return;
+  }
+
+  servo_velocity_q8 = speed * dir;
+  servo_position_q8 += servo_velocity_q8;
+
+  // Never past the ends, whatever the profile does
+  if(servo_position_q8 < ((int32_t)SERVO_MIN << 8)) {
+    servo_position_q8 = (int32_t)SERVO_MIN << 8;
+    servo_velocity_q8 = 0;
+  }
+  else if(servo_position_q8 > ((int32_t)SERVO_MAX << 8)) {
+    servo_position_q8 = (int32_t)SERVO_MAX << 8;
+    servo_velocity_q8 = 0;
+  }
+}
+
+// Once per PWM frame, at TOP
 ISR(TIMER1_CAPT_vect) 
 {
+  PROFILE_BEGIN(timer1_capt);
+
+  servo_step();
 
+  uint16_t pulse = (servo_position_q8 + 128) >> 8;
+  if(pulse != servo_output) {       // Leave OCR1A alone when nothing changed
+    OCR1A = pulse;
+    servo_output = pulse;
+  }
+
+  PROFILE_END(timer1_capt);
 }
 
-// en_IRQ enables input capture interrupt (might be useful later)
+// en_IRQ enables the input capture interrupt, which runs the motion engine. Without it moves happen straight away
 void servo_setup(uint8_t en_IRQ) 
 { 
   DDRB    |= (1 << PORTB1);
   TCCR1A  |= (1 << COM1A1) | (1 << COM1B1); // non-inv PWM on channels A and B
   TCCR1B  |= (1 << WGM13);  // PWM, Phase and Frequency Correct. TOP = ICR1.
   ICR1    = PWM_TOP; // 50Hz PWM
-  OCR1A   = 188;  // For 0 degree angle
+  OCR1A   = SERVO_MIDDLE;  // For 0 degree angle
   OCR1B   = 0; 
   TCCR1B |= ((1 << CS11) | (1 << CS10)); // Timer prescaler of 64
+  servo_irq = en_IRQ;
   if (en_IRQ)
     TIMSK1 |= (1 << ICIE1); // enable Input Capture Interrupt. NOTE: the ISR MUST be defined!!! 
 }
 
-// DO NOT USE MAP IN FINAL VERSION. ATMEGA328P DOESN'T HAVE DIVISION HARDWARE
-long servo_map(long x, long in_min, long in_max, long out_min, long out_max) 
+void set_servo_angle(uint8_t angle)
 {
-  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+  set_servo_pulse(servo_angle_to_pulse(angle)); // Multiply and shift instead of the old servo_map() division
 }
 
-void set_servo_angle(uint8_t angle)
+// Jump straight to pulse. With the engine running it's still written at the next frame boundary
+void set_servo_pulse(uint16_t pulse)
 {
-  uint16_t target;
-  if(angle <= 90)
-  {
-    target = servo_map(angle, 0, 90, SERVO_MIN, SERVO_MIDDLE);
+  uint8_t sreg = SREG;
+  cli();
+  servo_target = pulse;
+  servo_jump = 1;
+  if(!servo_irq) {
+    OCR1A = pulse;
+    servo_output = pulse;
   }
-  else
-  {
-    target = servo_map(angle, 91, 180, SERVO_MIDDLE, SERVO_MAX);
+  SREG = sreg;
+}
+
+void servo_move_to(uint16_t pulse, uint16_t max_rate, uint16_t accel)
+{
+  if(pulse < SERVO_MIN)
+    pulse = SERVO_MIN;
+  else if(pulse > SERVO_MAX)
+    pulse = SERVO_MAX;
+
+  if(!servo_irq) {
+    set_servo_pulse(pulse);
+    return;
   }
 
-  OCR1A = target;
+  uint8_t sreg = SREG;
+  cli();
+  servo_target = pulse;
+  servo_max_rate = max_rate;
+  servo_accel = accel;
+  SREG = sreg;
 }
 
-void set_servo_pulse(uint16_t pulse)
+uint8_t servo_moving()
 {
-  OCR1A = pulse;
+  uint8_t sreg = SREG;
+  cli();
+  uint8_t moving = servo_jump || servo_output != servo_target || servo_velocity_q8 != 0;
+  SREG = sreg;
+
+  return moving;
+}
+
+uint16_t servo_position()
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t pulse = servo_output;
+  SREG = sreg;
+
+  return pulse;
 }
 
 void servo_test()
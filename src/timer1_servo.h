@@ -3,13 +3,26 @@
 
 #include <inttypes.h>
 
-void servo_setup(uint8_t en_IRQ);
+#define SERVO_FRAME_HZ 50
+
+// Motion limits are in 1/256 ticks per frame (and per frame per frame). These convert from per second,
+// constant arguments only. SERVO_NO_LIMIT moves in one frame / skips the ramp
+#define SERVO_NO_LIMIT 0
+#define SERVO_RATE(ticks_per_s) ((uint16_t)(((ticks_per_s) * 256UL) / SERVO_FRAME_HZ))
+#define SERVO_ACCEL(ticks_per_s2) ((uint16_t)(((ticks_per_s2) * 256UL) / (SERVO_FRAME_HZ * SERVO_FRAME_HZ)))
+#define SERVO_RATE_PER_FRAME(ticks) ((uint16_t)(ticks) << 8)
 
-long servo_map(long x, long in_min, long in_max, long out_min, long out_max);
+void servo_setup(uint8_t en_IRQ);
 
 void set_servo_angle(uint8_t angle);
 
-void set_servo_pulse(uint16_t pulse);
+void set_servo_pulse(uint16_t pulse);     // Jump to pulse, no ramp
+
+void servo_move_to(uint16_t pulse, uint16_t max_rate, uint16_t accel); // Ramp to pulse in the background
+
+uint8_t servo_moving();                   // 1 until the output has reached the target
+
+uint16_t servo_position();                // Pulse currently being output
 
 void servo_test();
 
@@ -0,0 +1,128 @@
+/*
+  Host-side check of the division-free conversions in src/convert.h against the arithmetic they replaced.
+  Every input that can reach them is tried where that's feasible (all uint16_t echo times, every servo
+  angle and pulse), and the compile-time constants are compared with what they were worked out from.
+  Prints each failure and exits 1 if there were any.
+
+  Build: gcc -O2 -Wall -I../src -o convert_test convert_test.c -lm
+  Usage: convert_test
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "convert.h"
+
+static unsigned long failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { failures++; if(failures <= 20) printf(__VA_ARGS__); } } while(0)
+
+// What set_servo_angle() used before convert.h
+static long servo_map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+static long servo_reference(int angle)
+{
+  if(angle <= 90)
+    return servo_map(angle, 0, 90, SERVO_MIN, SERVO_MIDDLE);
+  else
+    return servo_map(angle, 91, 180, SERVO_MIDDLE, SERVO_MAX);
+}
+
+static void test_echo(void)
+{
+  for(uint32_t us = 0; us <= 0xFFFF; us++)
+    CHECK(us_echo_to_cm(us) == us / US_US_PER_CM, "us_echo_to_cm(%lu) = %u, want %lu\n",
+          (unsigned long)us, us_echo_to_cm(us), (unsigned long)(us / US_US_PER_CM));
+}
+
+static void test_servo(void)
+{
+  for(int angle = 0; angle <= 180; angle++) {
+    uint16_t pulse = servo_angle_to_pulse(angle);
+
+    CHECK(pulse == servo_reference(angle), "servo_angle_to_pulse(%d) = %u, want %ld\n",
+          angle, pulse, servo_reference(angle));
+    CHECK(servo_pulse_to_angle(pulse) == angle || servo_angle_to_pulse(servo_pulse_to_angle(pulse)) == pulse,
+          "servo_pulse_to_angle(%u) = %u, doesn't give the pulse back\n", pulse, servo_pulse_to_angle(pulse));
+  }
+
+  // Every pulse, in range or not, comes back as an angle that's in range and no further than a degree out
+  for(uint32_t pulse = 0; pulse <= 0xFFFF; pulse++) {
+    uint8_t angle = servo_pulse_to_angle(pulse);
+    uint16_t back = servo_angle_to_pulse(angle);
+    uint16_t clamped = (pulse < SERVO_MIN) ? SERVO_MIN : (pulse > SERVO_MAX) ? SERVO_MAX : pulse;
+
+    CHECK(angle <= 180 && abs((int)back - (int)clamped) <= 2, "servo_pulse_to_angle(%lu) = %u (pulse %u)\n",
+          (unsigned long)pulse, angle, back);
+  }
+
+  // Sub-degree headings: whole degrees match servo_heading_to_pulse(), and the pulse never goes backwards
+  uint16_t last = SERVO_MIN;
+  for(int32_t heading = (int32_t)91 << 16; heading >= -((int32_t)91 << 16); heading--) {
+    uint16_t pulse = servo_heading_q16_to_pulse(heading);
+
+    if((heading & 0xFFFF) == 0 && heading >= -((int32_t)90 << 16) && heading <= ((int32_t)90 << 16))
+      CHECK(pulse == servo_heading_to_pulse(heading >> 16), "servo_heading_q16_to_pulse(%ld deg) = %u, want %u\n",
+            (long)(heading >> 16), pulse, servo_heading_to_pulse(heading >> 16));
+    CHECK(pulse >= last, "servo_heading_q16_to_pulse(%ld) = %u, after %u\n", (long)heading, pulse, last);
+    last = pulse;
+  }
+}
+
+static void test_gyro(void)
+{
+  // The multipliers set_gyro_config() had typed in before they were worked out from the sensitivity
+  static const struct { uint16_t m; uint8_t shift; uint16_t want; double lsb; } scales[] = {
+    {GYRO_SCALE_M_250, GYRO_SCALE_SHIFT_250, 33573, 131.0},
+    {GYRO_SCALE_M_500, GYRO_SCALE_SHIFT_500, 33573, 65.5},
+    {GYRO_SCALE_M_1000, GYRO_SCALE_SHIFT_1000, 33522, 32.8},
+    {GYRO_SCALE_M_2000, GYRO_SCALE_SHIFT_2000, 33522, 16.4},
+  };
+
+  for(unsigned i = 0; i < sizeof(scales) / sizeof(scales[0]); i++) {
+    CHECK(scales[i].m == scales[i].want, "GYRO_SCALE_M for %.1f LSB/dps = %u, want %u\n",
+          scales[i].lsb, scales[i].m, scales[i].want);
+
+    // Every rate over 10ms: a 16 bit multiplier is good to 1 part in 2^15, plus the step lost to the shift
+    for(int32_t counts = -32768; counts <= 32767; counts++) {
+      int64_t increment = ((int64_t)counts * 10000 * scales[i].m) >> scales[i].shift;
+      double exact = counts * 0.01 / scales[i].lsb * 65536;
+      double error = increment - exact;
+
+      CHECK(error < 1 + fabs(exact) / 32768 && -error < 1 + fabs(exact) / 32768,
+            "gyro %.1f LSB/dps, %ld counts: %lld, want %.1f\n", scales[i].lsb, (long)counts, (long long)increment, exact);
+    }
+  }
+}
+
+static void test_ubrr(void)
+{
+  static const long bauds[] = {2400, 4800, 9600, 19200, 38400, 57600, 115200};
+
+  CHECK(UART_UBRR(9600) == 103, "UART_UBRR(9600) = %u, want 103 (the old UBRR_9600)\n", UART_UBRR(9600));
+
+  for(unsigned i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+    volatile long baud = bauds[i];  // So the reference really is the runtime division
+
+    CHECK(UART_UBRR(bauds[i]) == (uint16_t)(F_CPU / 16 / baud - 1), "UART_UBRR(%ld) = %u, want %lu\n",
+          bauds[i], UART_UBRR(bauds[i]), (unsigned long)(F_CPU / 16 / baud - 1));
+  }
+}
+
+int main(void)
+{
+  test_echo();
+  test_servo();
+  test_gyro();
+  test_ubrr();
+
+  if(failures) {
+    printf("%lu failures\n", failures);
+    return 1;
+  }
+
+  printf("all conversions match\n");
+  return 0;
+}
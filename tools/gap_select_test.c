@@ -0,0 +1,127 @@
+/*
+  Host-side test of gap selection (src/gap_select.h) on recorded scans. The first two profiles were
+  logged from find_gaps() in the simulator (sim/, default course); the rest are made from them by opening
+  up or mirroring part of the sweep, so the cases the simulator's course never produces are covered too.
+  Prints each failure and exits 1 if there were any.
+
+  Build: gcc -O2 -Wall -I../src -o gap_select_test gap_select_test.c ../src/gap_select.c
+  Usage: gap_select_test
+*/
+#include <stdio.h>
+#include <string.h>
+#include "gap_select.h"
+
+// The driver's settings (final_project_driver.c)
+#define CLEAR_CM 37
+#define MIN_BINS GAP_BINS_FOR_WIDTH(30, CLEAR_CM)
+
+typedef struct {
+  int8_t heading;
+  uint16_t range_cm;
+} reading_t;
+
+// Wall across the front, the corner of the course open far to the left
+static const reading_t corner[] = {
+  {90, 36}, {90, 265}, {86, 500}, {73, 30}, {64, 24}, {55, 21}, {47, 19}, {38, 17}, {29, 16}, {20, 15}, {12, 15},
+  {3, 15}, {-7, 15}, {-15, 15}, {-24, 15}, {-33, 15}, {-42, 16}, {-50, 17}, {-59, 19}, {-68, 21}, {-77, 25}
+};
+
+// Boxed in: nothing further than 45cm anywhere
+static const reading_t boxed[] = {
+  {90, 33}, {90, 45}, {86, 35}, {77, 27}, {69, 23}, {60, 20}, {51, 18}, {42, 16}, {34, 16}, {25, 15}, {16, 14},
+  {7, 14}, {-2, 15}, {-11, 15}, {-20, 15}, {-29, 16}, {-37, 17}, {-46, 17}, {-55, 19}, {-63, 22}, {-72, 26}
+};
+
+static unsigned failures = 0;
+
+static void load(scan_t *scan, const reading_t *r, uint8_t count)
+{
+  memset(scan, 0, sizeof(*scan));
+  for(uint8_t i = 0; i < count; i++) {
+    scan->points[i].heading = r[i].heading;
+    scan->points[i].range_cm = r[i].range_cm;
+  }
+  scan->count = count;
+}
+
+// Every reading between from and to degrees (inclusive) set to range_cm
+static void open_up(scan_t *scan, int8_t from, int8_t to, uint16_t range_cm)
+{
+  for(uint8_t i = 0; i < scan->count; i++)
+    if(scan->points[i].heading >= from && scan->points[i].heading <= to)
+      scan->points[i].range_cm = range_cm;
+}
+
+static void mirror(scan_t *scan)
+{
+  for(uint8_t i = 0; i < scan->count; i++)
+    scan->points[i].heading = -scan->points[i].heading;
+}
+
+static void expect(const char *name, const scan_t *scan, uint8_t found, int8_t heading)
+{
+  gap_result_t result;
+  uint8_t got = gap_select(scan, CLEAR_CM, MIN_BINS, &result);
+
+  if(got != found || result.heading != heading) {
+    printf("%s: found %u heading %d, want found %u heading %d\n", name, got, result.heading, found, heading);
+    failures++;
+  }
+}
+
+int main(void)
+{
+  scan_t scan;
+
+  // Nothing wide enough: head for the furthest sector, the open corner on the far left
+  load(&scan, corner, sizeof(corner) / sizeof(corner[0]));
+  expect("corner, no gap", &scan, GAP_NONE, 88);
+
+  load(&scan, boxed, sizeof(boxed) / sizeof(boxed[0]));
+  expect("boxed in, no gap", &scan, GAP_NONE, 88);
+
+  // The wall ends on the left: the smallest turn that gets the whole hull into the opening. Smoothing
+  // spreads the edge of the opening a bin towards the wall, to 12 degrees, then half the hull is 24
+  load(&scan, corner, sizeof(corner) / sizeof(corner[0]));
+  open_up(&scan, 20, 90, 300);
+  expect("clear left", &scan, GAP_FOUND, 36);
+
+  // The same, mirrored. -12 degrees falls in the bin that ends at -4, so the edge is at -4 and the turn is
+  // a bin less than on the left
+  mirror(&scan);
+  expect("clear right", &scan, GAP_FOUND, -28);
+
+  // Clear everywhere ahead: keep going straight
+  load(&scan, boxed, sizeof(boxed) / sizeof(boxed[0]));
+  open_up(&scan, -40, 40, 300);
+  expect("clear ahead", &scan, GAP_FOUND, 0);
+
+  // An opening narrower than the hull is rejected, and the furthest sector (the opening) is the fallback
+  load(&scan, boxed, sizeof(boxed) / sizeof(boxed[0]));
+  open_up(&scan, -20, -11, 300);
+  expect("too narrow", &scan, GAP_NONE, -16);
+
+  // No readings at all (the sensor never answered) isn't open space, whatever the empty bins would say
+  load(&scan, corner, 0);
+  expect("empty scan", &scan, GAP_NO_SCAN, 0);
+  scan.timeouts = 21;
+  expect("dead sensor", &scan, GAP_NO_SCAN, 0);
+
+  // Mostly unanswered: the few readings would be stretched over the whole sweep
+  load(&scan, corner, 5);
+  scan.timeouts = 16;
+  expect("flaky sensor", &scan, GAP_NO_SCAN, 0);
+
+  // A few missed pings are fine
+  load(&scan, boxed, sizeof(boxed) / sizeof(boxed[0]));
+  scan.timeouts = 3;
+  expect("boxed in, some missed", &scan, GAP_NONE, 88);
+
+  if(failures) {
+    printf("%u failures\n", failures);
+    return 1;
+  }
+
+  printf("all gap selections match\n");
+  return 0;
+}
@@ -0,0 +1,368 @@
+/*
+  Host-side decoder for the hovercraft's binary telemetry (see src/telemetry.h).
+  Reads COBS frames from a serial port, a capture file or stdin and writes one CSV line per packet to stdout.
+  Bad frames and gaps in the sequence numbers are counted and reported on stderr.
+  A flight recorder dump (src/recorder.h) is unpacked into its own CSV, one line per recorded frame,
+  written to the file given with -r. Without -r it's only summarised on stderr.
+
+  Build: gcc -O2 -Wall -I../src -o telemetry_decode telemetry_decode.c
+  Usage: telemetry_decode [-r recorder.csv] [device or file] [baud]
+         telemetry_decode /dev/ttyUSB0 9600 > run.csv
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "telemetry.h"
+#include "recorder.h"
+
+#define MAX_FRAME 256
+
+static unsigned long packets = 0, bad_frames = 0, missed = 0;
+
+// Flight recorder dump, collected until its end packet
+#define CHUNKS_PER_BLOCK (RECORDER_BLOCK_BYTES / RECORDER_CHUNK_BYTES)
+
+typedef struct {
+  uint8_t seq;
+  uint8_t chunks;         // Bit per chunk received
+  uint8_t data[RECORDER_BLOCK_BYTES];
+} dump_block_t;
+
+typedef struct {
+  const char *name;
+  int bits, shift, step;
+} field_t;
+
+#define FIELD(name, bits, shift, step) {#name, bits, shift, step},
+static const field_t fields[] = { RECORDER_FIELDS(FIELD) };
+#undef FIELD
+
+static FILE *recorder_csv = NULL;
+static dump_block_t dump[256];
+static int dump_blocks = 0;
+
+static speed_t baud_constant(long baud)
+{
+  switch(baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return 0;
+  }
+}
+
+// Put a serial port into raw mode at the given baud rate. Does nothing for regular files
+static int configure_port(int fd, long baud)
+{
+  struct termios tty;
+
+  if(!isatty(fd))
+    return 0;
+
+  if(tcgetattr(fd, &tty) != 0)
+    return -1;
+
+  speed_t speed = baud_constant(baud);
+  if(!speed) {
+    fprintf(stderr, "unsupported baud rate %ld\n", baud);
+    return -1;
+  }
+
+  cfmakeraw(&tty);
+  cfsetispeed(&tty, speed);
+  cfsetospeed(&tty, speed);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cc[VMIN] = 1;
+  tty.c_cc[VTIME] = 0;
+
+  return tcsetattr(fd, TCSANOW, &tty);
+}
+
+// Undo COBS. Returns the decoded length, or -1 if the frame is malformed
+static int cobs_decode(const uint8_t *in, int length, uint8_t *out)
+{
+  int i = 0, n = 0;
+
+  while(i < length) {
+    uint8_t code = in[i++];
+
+    if(code == 0 || i + code - 1 > length)
+      return -1;
+
+    for(int j = 1; j < code; j++)
+      out[n++] = in[i++];
+
+    if(code < 0xFF && i < length)
+      out[n++] = 0;
+  }
+
+  return n;
+}
+
+static void print_header(void)
+{
+  printf("seq,time_us,accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,roll,pitch,yaw,"
+         "range_cm,servo_pulse,thrust_fan,lift_fan,flags\n");
+}
+
+// Most significant bit first, like the recorder writes them. -1 past the end of the block
+static long get_bits(const uint8_t *block, int *position, int count)
+{
+  long value = 0;
+
+  if(*position + count > RECORDER_BLOCK_BYTES * 8)
+    return -1;
+
+  while(count--) {
+    value = (value << 1) | ((block[*position >> 3] >> (7 - (*position & 7))) & 1);
+    (*position)++;
+  }
+
+  return value;
+}
+
+static int is_angle(const char *name)
+{
+  return strcmp(name, "yaw") == 0 || strcmp(name, "roll") == 0 || strcmp(name, "pitch") == 0;
+}
+
+// One CSV line per frame. Returns the number of frames, -1 if the block ran out before its frame count
+static int decode_block(const dump_block_t *b, uint32_t *time_ms)
+{
+  int count = sizeof(fields) / sizeof(fields[0]);
+  int position = RECORDER_HEADER_BYTES * 8;
+  long value[sizeof(fields) / sizeof(fields[0])];
+
+  for(int frame = 0; frame < b->data[1]; frame++) {
+    for(int i = 0; i < count; i++) {
+      long v, zigzag = 0;
+
+      // Keyframe and 111: the value itself. Otherwise 0, 10 or 110 and a delta (recorder.h)
+      if(frame > 0 && get_bits(b->data, &position, 1) == 0)
+        zigzag = 0;
+      else if(frame > 0 && get_bits(b->data, &position, 1) == 0)
+        zigzag = get_bits(b->data, &position, 4);
+      else if(frame > 0 && get_bits(b->data, &position, 1) == 0)
+        zigzag = get_bits(b->data, &position, 8);
+      else {
+        v = get_bits(b->data, &position, fields[i].bits);
+        if(v < 0)
+          return -1;
+        value[i] = (fields[i].bits == 16) ? (int16_t)v : v;
+        continue;
+      }
+
+      if(zigzag < 0)
+        return -1;
+      v = value[i] + fields[i].step + ((zigzag >> 1) ^ -(zigzag & 1));
+      value[i] = (fields[i].bits == 16) ? (int16_t)v : (uint8_t)v;
+    }
+
+    // time_ms is the low 16 bits of millis(): carry it on from the frame before
+    if(*time_ms == 0xFFFFFFFF)
+      *time_ms = (uint16_t)value[0];
+    else
+      *time_ms += (uint16_t)(value[0] - *time_ms);
+
+    fprintf(recorder_csv, "%u,%lu", b->seq, (unsigned long)*time_ms);
+    for(int i = 1; i < count; i++) {
+      if(is_angle(fields[i].name))
+        fprintf(recorder_csv, ",%.3f", value[i] * (1L << fields[i].shift) / 65536.0);
+      else
+        fprintf(recorder_csv, ",%ld", value[i] * (1L << fields[i].shift));
+    }
+    fprintf(recorder_csv, "\n");
+  }
+
+  return b->data[1];
+}
+
+static void handle_recorder_chunk(const recorder_chunk_t *c)
+{
+  dump_block_t *b = NULL;
+
+  if(c->offset % RECORDER_CHUNK_BYTES || c->offset >= RECORDER_BLOCK_BYTES)
+    return;
+
+  for(int i = 0; i < dump_blocks; i++)
+    if(dump[i].seq == c->block)
+      b = &dump[i];
+
+  // Blocks come oldest first, so keep them in the order they turn up
+  if(!b) {
+    if(dump_blocks == 256)
+      return;
+    b = &dump[dump_blocks++];
+    b->seq = c->block;
+    b->chunks = 0;
+  }
+
+  memcpy(&b->data[c->offset], c->data, RECORDER_CHUNK_BYTES);
+  b->chunks |= 1 << (c->offset / RECORDER_CHUNK_BYTES);
+}
+
+static void handle_recorder_end(const recorder_end_t *end)
+{
+  static const char *reasons[] = {"none", "bump", "turn timeout", "command", "end of course", "bad scan"};
+  uint32_t time_ms = 0xFFFFFFFF;
+  int frames = 0, broken = 0;
+
+  if(recorder_csv) {
+    fprintf(recorder_csv, "block,time_ms");
+    for(unsigned i = 1; i < sizeof(fields) / sizeof(fields[0]); i++)
+      fprintf(recorder_csv, ",%s", fields[i].name);
+    fprintf(recorder_csv, "\n");
+  }
+
+  for(int i = 0; i < dump_blocks; i++) {
+    int n = -1;
+
+    if(dump[i].chunks == (1 << CHUNKS_PER_BLOCK) - 1 && recorder_csv)
+      n = decode_block(&dump[i], &time_ms);
+    else if(dump[i].chunks == (1 << CHUNKS_PER_BLOCK) - 1)
+      n = dump[i].data[1];
+
+    if(n < 0)
+      broken++;
+    else
+      frames += n;
+  }
+
+  fprintf(stderr, "recorder: %d frames in %d of %u blocks (%d incomplete), trigger %s at %u ms\n",
+          frames, dump_blocks - broken, end->blocks, broken,
+          end->reason < sizeof(reasons) / sizeof(reasons[0]) ? reasons[end->reason] : "unknown",
+          end->trigger_time_ms);
+
+  if(recorder_csv)
+    fflush(recorder_csv);
+  dump_blocks = 0;
+}
+
+static void handle_packet(const uint8_t *packet, int length)
+{
+  static int last_seq = -1;
+  telemetry_header_t header;
+  uint16_t crc = 0xFFFF;
+
+  if(length < (int)sizeof(header) + 2) {
+    bad_frames++;
+    return;
+  }
+
+  for(int i = 0; i < length - 2; i++)
+    crc = telemetry_crc_update(crc, packet[i]);
+
+  if(crc != (packet[length - 2] | (packet[length - 1] << 8))) {
+    bad_frames++;
+    return;
+  }
+
+  memcpy(&header, packet, sizeof(header));
+  const uint8_t *payload = packet + sizeof(header);
+  int payload_length = length - sizeof(header) - 2;
+
+  if(last_seq >= 0)
+    missed += (uint8_t)(header.seq - last_seq - 1);
+  last_seq = header.seq;
+  packets++;
+
+  if(header.type == TELEMETRY_STATE && payload_length == sizeof(telemetry_state_t)) {
+    telemetry_state_t s;
+    memcpy(&s, payload, sizeof(s));
+
+    printf("%u,%lu,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%u,%u,%u,%u,%u\n",
+           header.seq, (unsigned long)header.time_us,
+           s.accel_x, s.accel_y, s.accel_z, s.gyro_x, s.gyro_y, s.gyro_z,
+           s.roll / 65536.0, s.pitch / 65536.0, s.yaw / 65536.0,
+           s.range_cm, s.servo_pulse, s.thrust_fan, s.lift_fan, s.flags);
+  }
+  else if(header.type == TELEMETRY_STEP && payload_length == sizeof(telemetry_step_t)) {
+    telemetry_step_t s;
+    memcpy(&s, payload, sizeof(s));
+
+    // Off the CSV, so the state log stays one table
+    fprintf(stderr, "step at %lu us: setpoint %.1f, step %.1f, overshoot %.1f deg, rise %u ms, settle %u ms\n",
+            (unsigned long)header.time_us, s.setpoint / 65536.0, s.step / 65536.0, s.overshoot / 65536.0,
+            s.rise_ms, s.settle_ms);
+  }
+  else if(header.type == TELEMETRY_RECORDER_CHUNK && payload_length == sizeof(recorder_chunk_t)) {
+    recorder_chunk_t c;
+    memcpy(&c, payload, sizeof(c));
+    handle_recorder_chunk(&c);
+  }
+  else if(header.type == TELEMETRY_RECORDER_END && payload_length == sizeof(recorder_end_t)) {
+    recorder_end_t e;
+    memcpy(&e, payload, sizeof(e));
+    handle_recorder_end(&e);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int fd = STDIN_FILENO;
+
+  if(argc > 2 && strcmp(argv[1], "-r") == 0) {
+    recorder_csv = fopen(argv[2], "w");
+    if(!recorder_csv) {
+      perror(argv[2]);
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
+  long baud = (argc > 2) ? atol(argv[2]) : 9600;
+
+  if(argc > 1) {
+    fd = open(argv[1], O_RDONLY | O_NOCTTY);
+    if(fd < 0) {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  if(configure_port(fd, baud) != 0) {
+    perror("configure port");
+    return 1;
+  }
+
+  uint8_t frame[MAX_FRAME], packet[MAX_FRAME], chunk[512];
+  int frame_length = 0, overflow = 0;
+  ssize_t n;
+
+  print_header();
+
+  while((n = read(fd, chunk, sizeof(chunk))) > 0) {
+    for(ssize_t i = 0; i < n; i++) {
+      if(chunk[i] != 0) {
+        if(frame_length < MAX_FRAME)
+          frame[frame_length++] = chunk[i];
+        else
+          overflow = 1;
+        continue;
+      }
+
+      // End of frame
+      if(frame_length > 0) {
+        int length = overflow ? -1 : cobs_decode(frame, frame_length, packet);
+        if(length < 0)
+          bad_frames++;
+        else
+          handle_packet(packet, length);
+      }
+
+      frame_length = 0;
+      overflow = 0;
+    }
+    fflush(stdout);
+  }
+
+  fprintf(stderr, "%lu packets, %lu bad frames, %lu missed\n", packets, bad_frames, missed);
+
+  return 0;
+}